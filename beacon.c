@@ -1,6 +1,11 @@
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
 #include <string.h>
 #include <pthread.h>
 #include <sys/socket.h>
@@ -10,65 +15,375 @@
 #include <syslog.h>
 
 #include "socketcand.h"
+#include "statistics.h"
+#include "metrics.h"
 #include "beacon.h"
+#include "listen.h"
 
-void *beacon_loop(void *ptr) {
-	int i, n, chars_left, ret;
+/*
+ * The beacon is built once and only the elements from the first changed
+ * value onwards are rendered again:
+ *
+ * <CANBeacon name="host" type="SocketCAN" description="socketcand">
+ * <URL>can://127.0.0.1:29536</URL><Bus name="vcan0" clients="1" load="12"/>
+ * <Capacity clients="1" free="255"/></CANBeacon>
+ *
+ * clients is the number of connections on the bus, load the bus load in
+ * percent over the last second and free the number of further connections
+ * the daemon can account. Unknown values are left out. The beacon does not
+ * start the collector: receiving every frame only for the load attribute
+ * would cost the idle daemon, so the load is only sent while the collector
+ * runs for the clients or the metrics.
+ *
+ * beacon_mode selects where the beacon goes: every beacon_interval seconds
+ * (with BEACON_JITTER against synchronized bursts of many daemons) to the
+ * broadcast address or a multicast group, or in 'query' mode only as unicast
+ * answer to a '<CANBeaconQuery/>' datagram on the beacon port.
+ */
+
+struct beacon_bus {
+	int offset; /* of the <Bus> element */
+	int clients;
+	int load;
+};
+
+char *beacon_mode; /* NULL or 'broadcast', 'query' or a multicast group */
+int beacon_ttl = BEACON_TTL;
+int beacon_interval = BEACON_INTERVAL;
+
+static char beacon[BEACON_LENGTH];
+static int beacon_len;
+static struct beacon_bus *busses;
+static int tail_offset; /* of the <Capacity> element */
+static int total_clients;
+
+static int beacon_append(int pos, const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(beacon + pos, BEACON_LENGTH - pos, fmt, ap);
+	va_end(ap);
+
+	if(len < 0)
+		return pos;
+	if(pos + len >= BEACON_LENGTH)
+		return BEACON_LENGTH - 1;
+
+	return pos + len;
+}
+
+static int beacon_bus(int pos, int i) {
+	busses[i].offset = pos;
+
+	pos = beacon_append(pos, "<Bus name=\"%s\"", interface_names[i]);
+	if(busses[i].clients >= 0)
+		pos = beacon_append(pos, " clients=\"%d\"", busses[i].clients);
+	if(busses[i].load >= 0)
+		pos = beacon_append(pos, " load=\"%d\"", busses[i].load);
+
+	return beacon_append(pos, "/>");
+}
+
+static int beacon_tail(int pos) {
+	tail_offset = pos;
+
+	if(total_clients >= 0)
+		pos = beacon_append(pos, "<Capacity clients=\"%d\" free=\"%d\"/>",
+				    total_clients, METRICS_MAX_CLIENTS - total_clients);
+
+	return beacon_append(pos, "</CANBeacon>");
+}
+
+static int beacon_init() {
+	char hostname[32], url[INET6_ADDRSTRLEN + 32];
+	int i, pos, ret;
+
+	busses = calloc(interface_count, sizeof(*busses));
+	if(busses == NULL)
+		return -1;
+
+	gethostname((char *) &hostname, (size_t)  32);
+	pos = beacon_append(0, "<CANBeacon name=\"%s\" type=\"%s\" description=\"%s\">\n",
+			    hostname, BEACON_TYPE, description);
+
+	/* every TCP endpoint the daemon listens on */
+	for(i=0;(ret = listen_url(i, url, sizeof(url))) >= 0;i++) {
+		if(ret > 0)
+			pos = beacon_append(pos, "<URL>%s</URL>", url);
+	}
+
+	for(i=0;i<interface_count;i++) {
+		busses[i].clients = busses[i].load = -1;
+		pos = beacon_bus(pos, i);
+	}
+
+	total_clients = -1;
+	beacon_len = beacon_tail(pos);
+
+	return 0;
+}
+
+/* patches the beacon from the first value that changed */
+static void beacon_update() {
+	struct rtnl_link_stats64 stats;
+	struct busload load;
+	int i, clients, value, first = -1, pos;
+
+	for(i=0;i<interface_count;i++) {
+		clients = metrics_clients(interface_names[i]);
+
+		value = -1;
+		/* the stopped collector publishes an unknown load */
+		if(!statistics_snapshot(i, &stats, &load, 0) && load.load1 >= 0)
+			value = load.load1 + 0.5;
+
+		if(first < 0 && (clients != busses[i].clients || value != busses[i].load))
+			first = i;
+
+		busses[i].clients = clients;
+		busses[i].load = value;
+	}
+
+	clients = metrics_clients(NULL);
+
+	if(first >= 0) {
+		pos = busses[first].offset;
+		for(i=first;i<interface_count;i++)
+			pos = beacon_bus(pos, i);
+	} else if(clients != total_clients) {
+		pos = tail_offset;
+	} else {
+		return;
+	}
+
+	total_clients = clients;
+	beacon_len = beacon_tail(pos);
+}
+
+/* the beacon is sent to the broadcast address of the listen interface */
+static int beacon_broadcast() {
 	int udp_socket;
 	int optval;
-	char buffer[BEACON_LENGTH];
-	char hostname[32];
 
 	if ((udp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
 		PRINT_ERROR("Failed to create broadcast socket");
-		return NULL;
+		return -1;
 	}
 
 	/* Activate broadcast option */
 	optval = 1;
-	ret = setsockopt(udp_socket, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(int));
-	if(ret) {
+	if(setsockopt(udp_socket, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(int))) {
 		PRINT_ERROR("Could not activate SO_BROADCAST\n");
 	}
 
 	/* Connect the socket */
 	if(connect(udp_socket, (struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr)) < 0) {
 		PRINT_ERROR("Failed to connect broadcast socket");
-		return NULL;
+		close(udp_socket);
+		return -1;
 	}
 
+	return udp_socket;
+}
+
+/* the beacon is sent to an IPv4 or IPv6 multicast group (e.g. ff02::4200%eth0) */
+static int beacon_multicast(const char *group) {
+	struct addrinfo hints, *ai;
+	char service[8];
+	unsigned int ifindex;
+	int udp_socket, ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	snprintf(service, sizeof(service), "%d", BROADCAST_PORT);
+
+	if((ret = getaddrinfo(group, service, &hints, &ai))) {
+		PRINT_ERROR("Invalid beacon mode '%s' %s\n", group, gai_strerror(ret));
+		return -1;
+	}
+
+	if((ai->ai_family == AF_INET &&
+	    !IN_MULTICAST(ntohl(((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr))) ||
+	   (ai->ai_family == AF_INET6 &&
+	    !IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr))) {
+		PRINT_ERROR("Beacon address '%s' is no multicast group\n", group);
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	if((udp_socket = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		PRINT_ERROR("Failed to create multicast socket");
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	if(ai->ai_family == AF_INET) {
+		ret = setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_TTL, &beacon_ttl, sizeof(beacon_ttl));
+		/* leave through the listen interface */
+		setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_IF, &saddr.sin_addr, sizeof(saddr.sin_addr));
+	} else {
+		ret = setsockopt(udp_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &beacon_ttl, sizeof(beacon_ttl));
+		ifindex = ((struct sockaddr_in6 *) ai->ai_addr)->sin6_scope_id;
+		if(!ifindex)
+			ifindex = if_nametoindex(interface_string);
+		setsockopt(udp_socket, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+	}
+
+	if(ret) {
+		PRINT_ERROR("Could not set the multicast TTL %d\n", beacon_ttl);
+	}
+
+	if(connect(udp_socket, ai->ai_addr, ai->ai_addrlen) < 0) {
+		PRINT_ERROR("Failed to connect multicast socket %s\n", strerror(errno));
+		close(udp_socket);
+		udp_socket = -1;
+	}
+
+	freeaddrinfo(ai);
+	return udp_socket;
+}
+
+/* interval in ms with up to BEACON_JITTER percent more or less */
+static int beacon_jitter(unsigned int *seed, int ms) {
+	int range = ms * BEACON_JITTER / 100;
+
+	if(range == 0)
+		return ms;
+
+	return ms - range + rand_r(seed) % (2 * range + 1);
+}
+
+static void beacon_announce(int udp_socket) {
+	unsigned int seed = getpid() ^ time(NULL);
+	struct timespec ts;
+	int ret, delay;
+
 	while(1) {
-		/* Build the beacon */
-		gethostname((char *) &hostname, (size_t)  32);
-		snprintf(buffer, BEACON_LENGTH, "<CANBeacon name=\"%s\" type=\"%s\" description=\"%s\">\n<URL>can://%s:%d</URL>",
-			 hostname, BEACON_TYPE, description, inet_ntoa( saddr.sin_addr ), port);
-
-		for(i=0;i<interface_count;i++) {
-			/* Find \0 in beacon buffer */
-			for(n=0;;n++) {
-				if(buffer[n] == '\0')
-					break;
-			}
-			chars_left = BEACON_LENGTH - n;
-
-			snprintf(buffer+(n*sizeof(char)), chars_left, "<Bus name=\"%s\"/>", interface_names[i]);
+		beacon_update();
+
+		ret = send(udp_socket, beacon, beacon_len, 0);
+		if(ret == -1) {
+			PRINT_ERROR("Error in beacon send()\n");
 		}
-        
-		/* Find \0 in beacon buffer */
-		for(n=0;;n++) {
-			if(buffer[n] == '\0')
-				break;
+		delay = beacon_jitter(&seed, beacon_interval * 1000);
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = (delay % 1000) * 1000000L;
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * Socket receiving the '<CANBeaconQuery .../>' datagrams. Several daemons on
+ * a host share the port, each of them gets the broadcast queries.
+ */
+static int beacon_query_open() {
+	struct sockaddr_in addr;
+	int udp_socket, on = 1;
+
+	if ((udp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		PRINT_ERROR("Failed to create beacon query socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(udp_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	/* queries are usually sent to the broadcast address */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(BROADCAST_PORT);
+
+	if(bind(udp_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Failed to bind beacon query socket %s\n", strerror(errno));
+		close(udp_socket);
+		return -1;
+	}
+
+	return udp_socket;
+}
+
+/* answers the queries to the beacon port with the beacon */
+static void beacon_answer(int udp_socket) {
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	char query[BEACON_LENGTH];
+	unsigned int seed = getpid() ^ time(NULL);
+	time_t second = 0;
+	int answers = 0, ret;
+
+	while(1) {
+		addrlen = sizeof(addr);
+		ret = recvfrom(udp_socket, query, sizeof(query) - 1, 0, (struct sockaddr *) &addr, &addrlen);
+		if(ret < (int) strlen(BEACON_QUERY))
+			continue;
+
+		query[ret] = '\0';
+		if(strncmp(query, BEACON_QUERY, strlen(BEACON_QUERY)))
+			continue;
+
+		/* the answers are larger than the queries - do not amplify floods */
+		if(time(NULL) != second) {
+			second = time(NULL);
+			answers = 0;
 		}
-		chars_left = BEACON_LENGTH - n;
+		if(++answers > BEACON_QUERY_RATE)
+			continue;
 
-		snprintf(buffer+(n*sizeof(char)), chars_left, "</CANBeacon>");
+		/* spread the answers of the daemons on the network */
+		usleep(rand_r(&seed) % (BEACON_QUERY_DELAY + 1) * 1000);
 
-		ret = send(udp_socket, buffer, strlen(buffer), 0);
-		if(ret == -1) {
-			PRINT_ERROR("Error in beacon send()\n");
+		beacon_update();
+		if(sendto(udp_socket, beacon, beacon_len, 0, (struct sockaddr *) &addr, addrlen) == -1) {
+			PRINT_ERROR("Error in beacon sendto() %s\n", strerror(errno));
 		}
-		sleep(3);
+	}
+}
+
+static int query_socket = -1;
+
+void *beacon_loop(void *ptr) {
+	int udp_socket;
+
+	if(beacon_init() < 0) {
+		PRINT_ERROR("Could not allocate the beacon\n");
+		return NULL;
+	}
+
+	if(beacon_interval < 1)
+		beacon_interval = BEACON_INTERVAL;
+
+	if(query_socket >= 0) {
+		beacon_answer(query_socket);
+	} else {
+		if(beacon_mode == NULL || !strcmp(beacon_mode, "broadcast"))
+			udp_socket = beacon_broadcast();
+		else
+			udp_socket = beacon_multicast(beacon_mode);
+
+		if(udp_socket >= 0)
+			beacon_announce(udp_socket);
 	}
 
 	return NULL;
 }
+
+void beacon_start() {
+	static int started;
+	pthread_t beacon_thread;
+
+	if(started)
+		return;
+	started = 1;
+
+	/* without the socket the query mode would silently never answer */
+	if(beacon_mode && !strcmp(beacon_mode, "query") && (query_socket = beacon_query_open()) < 0)
+		exit(1);
+
+	PRINT_VERBOSE("creating broadcast thread...\n");
+	if(pthread_create(&beacon_thread, NULL, &beacon_loop, NULL))
+		PRINT_ERROR("could not create broadcast thread.\n");
+}
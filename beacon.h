@@ -2,5 +2,17 @@
 #define BEACON_LENGTH 2048
 #define BEACON_TYPE "SocketCAN"
 #define BEACON_DESCRIPTION "socketcand"
+#define BEACON_INTERVAL 3 /* seconds */
+#define BEACON_INTERVAL_MAX 3600
+#define BEACON_TTL 1
+#define BEACON_JITTER 25 /* percent of the interval */
+#define BEACON_QUERY "<CANBeaconQuery"
+#define BEACON_QUERY_RATE 10 /* answers per second */
+#define BEACON_QUERY_DELAY 100 /* ms, longest random delay of an answer */
+
+extern char *beacon_mode;
+extern int beacon_ttl;
+extern int beacon_interval;
 
 void *beacon_loop(void *ptr);
+void beacon_start();
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE /* recvmmsg() */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <syslog.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "socketcand.h"
+#include "statistics.h"
+
+/*
+ * Bus load estimation
+ *
+ * The collector of the parent receives every frame of the busses on a RAW
+ * socket and accumulates the time the frame occupied the bus. The time is
+ * calculated from the frame length in bits with worst case bit stuffing and
+ * the bitrates of the interface. The load and the frame rate are reported
+ * over sliding windows of BUSLOAD_SHORT and BUSLOAD_LONG slots.
+ *
+ * Classic CAN (Davis et al.): g + 8n + 13 + (g + 8n - 1) / 4 bits with
+ * g = 34 (SFF) or 54 (EFF) bits of header and CRC subject to stuffing and 13
+ * bits of CRC delimiter, ACK, EOF and intermission.
+ *
+ * CAN FD: the arbitration phase up to BRS (17 bits SFF, 36 bits EFF) with
+ * dynamic stuffing and the final 13 bits (CRC delimiter, ACK, EOF,
+ * intermission) use the nominal bitrate. ESI, DLC and the data with dynamic
+ * stuffing as well as the stuff count and the CRC with their fixed stuff
+ * bits use the data bitrate when BRS is set.
+ */
+
+#define BUSLOAD_BATCH 32 /* frames per recvmmsg() */
+#define BUSLOAD_RCVBUF (1024 * 1024)
+
+struct busload_bus {
+	__u32 bitrate;
+	__u32 data_bitrate;
+	unsigned long long busy_ns; /* current slot */
+	unsigned int frames;
+	unsigned long long slot_busy_ns[BUSLOAD_LONG];
+	unsigned int slot_frames[BUSLOAD_LONG];
+	unsigned int slot_ms[BUSLOAD_LONG];
+	struct busload load;
+};
+
+static struct busload_bus *busses;
+static int slot_pos, slots_filled;
+
+void busload_init() {
+	int i;
+
+	busses = calloc(interface_count, sizeof(*busses));
+	if(busses == NULL)
+		return;
+
+	for(i=0;i<interface_count;i++)
+		busses[i].load.load1 = busses[i].load.load10 = -1;
+}
+
+/* RAW socket receiving classic and FD frames of all CAN interfaces */
+int busload_open() {
+	struct sockaddr_can addr;
+	int fd, val;
+
+	if((fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW)) < 0) {
+		PRINT_ERROR("Error while opening bus load socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	val = 1;
+	setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &val, sizeof(val));
+
+	/* bursts arrive faster than the collector is scheduled */
+	val = BUSLOAD_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = 0; /* all interfaces */
+
+	if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding bus load socket %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void busload_set_bitrate(int bus, __u32 bitrate, __u32 data_bitrate) {
+	if(busses == NULL)
+		return;
+
+	busses[bus].bitrate = bitrate;
+	busses[bus].data_bitrate = data_bitrate ? data_bitrate : bitrate;
+}
+
+/* time in ns the frame occupied the bus or 0 when the bitrate is unknown */
+static unsigned long long frame_ns(struct busload_bus *b, struct canfd_frame *frame, int fd) {
+	unsigned int nominal, data, len, g;
+	__u32 rate;
+
+	if(b->bitrate == 0)
+		return 0;
+
+	len = (frame->can_id & CAN_RTR_FLAG) ? 0 : frame->len;
+
+	if(!fd) {
+		g = (frame->can_id & CAN_EFF_FLAG) ? 54 : 34;
+		nominal = g + 8 * len + 13 + (g + 8 * len - 1) / 4;
+		return (unsigned long long) nominal * 1000000000ULL / b->bitrate;
+	}
+
+	/* arbitration phase until the BRS bit and the tail */
+	g = (frame->can_id & CAN_EFF_FLAG) ? 36 : 17;
+	nominal = g + (g - 1) / 4 + 13;
+
+	/* ESI, DLC and data with dynamic stuffing */
+	data = 5 + 8 * len;
+	data += data / 4;
+	/* stuff count and CRC17/CRC21 with the fixed stuff bits */
+	data += 4 + ((len > 16) ? 21 + 7 : 17 + 6);
+
+	rate = (frame->flags & CANFD_BRS) ? b->data_bitrate : b->bitrate;
+
+	return (unsigned long long) nominal * 1000000000ULL / b->bitrate +
+		(unsigned long long) data * 1000000000ULL / rate;
+}
+
+/* accounts the pending frames - ifindex maps the busses to their interface index */
+void busload_receive(int fd, int *ifindex) {
+	struct canfd_frame frames[BUSLOAD_BATCH];
+	struct sockaddr_can addrs[BUSLOAD_BATCH];
+	struct mmsghdr msgs[BUSLOAD_BATCH];
+	struct iovec iovs[BUSLOAD_BATCH];
+	int i, n, bus;
+
+	if(busses == NULL)
+		return;
+
+	for(i=0;i<BUSLOAD_BATCH;i++) {
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(frames[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+
+	while((n = recvmmsg(fd, msgs, BUSLOAD_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+		for(i=0;i<n;i++) {
+			for(bus=0;bus<interface_count;bus++) {
+				if(ifindex[bus] && ifindex[bus] == addrs[i].can_ifindex)
+					break;
+			}
+
+			if(bus < interface_count && !(frames[i].can_id & CAN_ERR_FLAG)) {
+				busses[bus].frames++;
+				busses[bus].busy_ns += frame_ns(&busses[bus], &frames[i],
+								msgs[i].msg_len == CANFD_MTU);
+			}
+
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		if(n < BUSLOAD_BATCH)
+			break;
+	}
+}
+
+static void busload_window(struct busload_bus *b, int slots, double *load, double *fps) {
+	unsigned long long busy = 0, frames = 0, ms = 0;
+	int i, pos;
+
+	if(slots > slots_filled)
+		slots = slots_filled;
+
+	for(i=1;i<=slots;i++) {
+		pos = (slot_pos - i + BUSLOAD_LONG) % BUSLOAD_LONG;
+		busy += b->slot_busy_ns[pos];
+		frames += b->slot_frames[pos];
+		ms += b->slot_ms[pos];
+	}
+
+	if(ms == 0) {
+		*fps = 0;
+		*load = -1;
+		return;
+	}
+
+	*fps = frames * 1000.0 / ms;
+	*load = (b->bitrate) ? busy / (ms * 10000.0) : -1; /* percent */
+}
+
+/* closes the current slot that lasted ms and updates the windows */
+void busload_tick(unsigned int ms) {
+	struct busload_bus *b;
+	int i;
+
+	if(busses == NULL)
+		return;
+
+	for(i=0;i<interface_count;i++) {
+		b = &busses[i];
+		b->slot_busy_ns[slot_pos] = b->busy_ns;
+		b->slot_frames[slot_pos] = b->frames;
+		b->slot_ms[slot_pos] = ms;
+		b->busy_ns = 0;
+		b->frames = 0;
+	}
+
+	slot_pos = (slot_pos + 1) % BUSLOAD_LONG;
+	if(slots_filled < BUSLOAD_LONG)
+		slots_filled++;
+
+	for(i=0;i<interface_count;i++) {
+		b = &busses[i];
+		busload_window(b, BUSLOAD_SHORT, &b->load.load1, &b->load.fps1);
+		busload_window(b, BUSLOAD_LONG, &b->load.load10, &b->load.fps10);
+	}
+}
+
+/* drops the history when the collector pauses */
+void busload_reset() {
+	int i;
+
+	if(busses == NULL)
+		return;
+
+	slot_pos = slots_filled = 0;
+	for(i=0;i<interface_count;i++) {
+		busses[i].busy_ns = 0;
+		busses[i].frames = 0;
+		busses[i].load.load1 = busses[i].load.load10 = -1;
+		busses[i].load.fps1 = busses[i].load.fps10 = 0;
+	}
+}
+
+void busload_get(int bus, struct busload *load) {
+	if(busses)
+		*load = busses[bus].load;
+}
@@ -0,0 +1,287 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "uds.h"
+
+/*
+ * Flashing of an image from flash_dir with the UDS download sequence
+ *
+ *   RequestDownload     34 00 44 address size  ->  74 LFI maxNumberOfBlockLength
+ *   TransferData        36 counter data         ->  76 counter    (repeated)
+ *   RequestTransferExit 37                      ->  77
+ *
+ * Every step has to be answered positively, the first negative response
+ * or timeout aborts the job. The progress is reported to the client for
+ * each percent of the image.
+ */
+
+#define FLASH_REQUEST_DOWNLOAD 0
+#define FLASH_TRANSFER_DATA 1
+#define FLASH_TRANSFER_EXIT 2
+#define FLASH_DONE 3
+
+#define FLASH_RESULT_LEN 64
+
+char *flash_dir = NULL;
+
+struct flash_job {
+	int fd;
+	int step;
+	unsigned long address;
+	unsigned long size;
+	unsigned long offset; /* bytes acknowledged by the ECU */
+	int block_len; /* data bytes per TransferData */
+	int last_len; /* data bytes of the current TransferData */
+	unsigned char counter; /* blockSequenceCounter */
+	int percent; /* last reported progress */
+	char result[FLASH_RESULT_LEN]; /* 'ok' or the reason of the failure */
+	unsigned char req[ISOTPLEN];
+};
+
+static void flash_fail(struct flash_job *flash, unsigned char *data, int len) {
+	if (data == NULL) {
+		strcpy(flash->result, "error -");
+		return;
+	}
+
+	if (len > (FLASH_RESULT_LEN - 8) / 2)
+		len = (FLASH_RESULT_LEN - 8) / 2;
+
+	strcpy(flash->result, "error ");
+	flash->result[6 + hex_encode(flash->result + 6, data, len)] = '\0';
+}
+
+static int flash_next(struct uds_job *job, unsigned char **req) {
+	struct flash_job *flash = job->priv;
+	int len;
+
+	*req = flash->req;
+
+	switch (flash->step) {
+
+	case FLASH_REQUEST_DOWNLOAD:
+		flash->req[0] = 0x34;
+		flash->req[1] = 0x00; /* dataFormatIdentifier: no compression/encryption */
+		flash->req[2] = 0x44; /* 4 bytes memorySize, 4 bytes memoryAddress */
+		flash->req[3] = flash->address >> 24;
+		flash->req[4] = flash->address >> 16;
+		flash->req[5] = flash->address >> 8;
+		flash->req[6] = flash->address;
+		flash->req[7] = flash->size >> 24;
+		flash->req[8] = flash->size >> 16;
+		flash->req[9] = flash->size >> 8;
+		flash->req[10] = flash->size;
+		return 11;
+
+	case FLASH_TRANSFER_DATA:
+		len = flash->block_len;
+		if (flash->size - flash->offset < len)
+			len = flash->size - flash->offset;
+
+		if (pread(flash->fd, flash->req + 2, len, flash->offset) != len) {
+			PRINT_ERROR("Error while reading flash image %s\n", strerror(errno));
+			strcpy(flash->result, "error read");
+			return 0;
+		}
+
+		flash->req[0] = 0x36;
+		flash->req[1] = flash->counter;
+		flash->last_len = len;
+		return len + 2;
+
+	case FLASH_TRANSFER_EXIT:
+		flash->req[0] = 0x37;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void flash_progress(struct uds_job *job) {
+	struct flash_job *flash = job->priv;
+	char buf[64];
+	int percent = flash->offset * 100 / flash->size;
+
+	if (percent == flash->percent)
+		return;
+
+	flash->percent = percent;
+
+	if (job->ch == UNTAGGED_CHANNEL)
+		sprintf(buf, "< flashprogress %lu %lu >", flash->offset, flash->size);
+	else
+		sprintf(buf, "< chflashprogress %d %lu %lu >", job->ch, flash->offset, flash->size);
+	client_send(buf, strlen(buf), 0);
+}
+
+static int flash_response(struct uds_job *job, unsigned char *data, int len) {
+	struct flash_job *flash = job->priv;
+	unsigned long max_len = 0;
+	int i, n;
+
+	if (data == NULL || data[0] == UDS_SID_NEGATIVE) {
+		flash_fail(flash, data, len);
+		return -1;
+	}
+
+	switch (flash->step) {
+
+	case FLASH_REQUEST_DOWNLOAD:
+		/* lengthFormatIdentifier: size of maxNumberOfBlockLength in the high nibble */
+		n = (len > 1) ? data[1] >> 4 : 0;
+		if (n < 1 || n > 4 || len < 2 + n) {
+			flash_fail(flash, data, len);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++)
+			max_len = (max_len << 8) | data[2 + i];
+
+		/* maxNumberOfBlockLength includes the SID and the counter */
+		if (max_len > ISOTPLEN)
+			max_len = ISOTPLEN;
+		if (max_len < 3) {
+			flash_fail(flash, data, len);
+			return -1;
+		}
+
+		flash->block_len = max_len - 2;
+		flash->counter = 1;
+		flash->step = (flash->size) ? FLASH_TRANSFER_DATA : FLASH_TRANSFER_EXIT;
+		break;
+
+	case FLASH_TRANSFER_DATA:
+		if (len < 2 || data[1] != flash->counter) {
+			flash_fail(flash, data, len);
+			return -1;
+		}
+
+		flash->offset += flash->last_len;
+		flash->counter++; /* wraps from FFh to 00h */
+		flash_progress(job);
+
+		if (flash->offset >= flash->size)
+			flash->step = FLASH_TRANSFER_EXIT;
+		break;
+
+	case FLASH_TRANSFER_EXIT:
+		strcpy(flash->result, "ok");
+		flash->step = FLASH_DONE;
+		break;
+	}
+
+	return 0;
+}
+
+static void flash_finish(struct uds_job *job) {
+	struct flash_job *flash = job->priv;
+	char buf[FLASH_RESULT_LEN + 32];
+
+	if (job->ch == UNTAGGED_CHANNEL)
+		sprintf(buf, "< flashdone %s >", flash->result);
+	else
+		sprintf(buf, "< chflashdone %d %s >", job->ch, flash->result);
+	client_send(buf, strlen(buf), 0);
+
+	PRINT_VERBOSE("flashing on channel %d finished: %s\n", job->ch, flash->result);
+}
+
+static void flash_free(struct uds_job *job) {
+	struct flash_job *flash = job->priv;
+
+	close(flash->fd);
+	free(flash);
+}
+
+static const struct uds_ops flash_ops = {
+	.next_request = flash_next,
+	.response = flash_response,
+	.finish = flash_finish,
+	.free = flash_free,
+};
+
+/* only plain file names inside flash_dir are accepted */
+static int flash_valid_name(char *name) {
+	int i;
+
+	if (name[0] == '\0' || name[0] == '.')
+		return 0;
+
+	for (i = 0; name[i]; i++) {
+		if (!isalnum(name[i]) && name[i] != '-' && name[i] != '_' && name[i] != '.')
+			return 0;
+	}
+
+	return 1;
+}
+
+/* parses 'p2 p2star address image >' starting at the given element */
+struct uds_job *uds_flash_new(int ch, char *buf, int element) {
+	struct flash_job *flash;
+	struct uds_job *job;
+	struct stat st;
+	char *ptr = element_start(buf, element);
+	char image[256], *path;
+	int p2, p2star;
+	unsigned long address;
+
+	if (flash_dir == NULL) {
+		PRINT_ERROR("flashing is disabled - no flash_dir configured\n");
+		return NULL;
+	}
+
+	if (ptr == NULL || sscanf(ptr, "%d %d %lx %255s", &p2, &p2star, &address, image) != 4 ||
+	    p2 <= 0 || p2star <= 0 || address > 0xFFFFFFFF || !flash_valid_name(image))
+		return NULL;
+
+	flash = malloc(sizeof(*flash));
+	if (flash == NULL)
+		return NULL;
+	memset(flash, 0, sizeof(*flash));
+
+	path = malloc(strlen(flash_dir) + strlen(image) + 2);
+	if (path == NULL) {
+		free(flash);
+		return NULL;
+	}
+	sprintf(path, "%s/%s", flash_dir, image);
+
+	flash->fd = open(path, O_RDONLY);
+	free(path);
+
+	if (flash->fd < 0 || fstat(flash->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size > 0xFFFFFFFF) {
+		PRINT_ERROR("Could not open flash image '%s'\n", image);
+		if (flash->fd >= 0)
+			close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	flash->address = address;
+	flash->size = st.st_size;
+	flash->step = FLASH_REQUEST_DOWNLOAD;
+	flash->percent = -1;
+	strcpy(flash->result, "error -");
+
+	job = uds_job_new(ch, p2, p2star, &flash_ops, flash);
+	if (job == NULL) {
+		close(flash->fd);
+		free(flash);
+		return NULL;
+	}
+
+	return job;
+}
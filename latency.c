@@ -0,0 +1,124 @@
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "socketcand.h"
+
+/*
+ * Forwarding latency histograms
+ *
+ * Values in ns are sorted into log-linear buckets: values below
+ * LAT_SUB_BUCKETS get their own bucket, above that every power of two is
+ * split into LAT_SUB_BUCKETS buckets, which gives a relative error of
+ * at most 12.5%. Recording is a clz and an increment.
+ *
+ * rx: kernel receive timestamp (CLOCK_REALTIME) to send() to the client
+ * tx: reception of the command (CLOCK_MONOTONIC) to the write to the bus
+ */
+
+static long long command_time; /* ns, CLOCK_MONOTONIC */
+
+static long long now_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int latency_bucket(unsigned long long val) {
+	int msb, idx;
+
+	if (val < LAT_SUB_BUCKETS)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+	idx = (msb - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS +
+		((val >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+
+	return (idx < LAT_BUCKETS) ? idx : LAT_BUCKETS - 1;
+}
+
+/* highest value that is sorted into the bucket */
+unsigned long long latency_bucket_limit(int idx) {
+	int msb;
+
+	if (idx < LAT_SUB_BUCKETS)
+		return idx;
+
+	msb = idx / LAT_SUB_BUCKETS + LAT_SUB_BITS - 1;
+	return ((unsigned long long) (LAT_SUB_BUCKETS + idx % LAT_SUB_BUCKETS + 1) <<
+		(msb - LAT_SUB_BITS)) - 1;
+}
+
+void latency_record(struct latency_hist *hist, long long val) {
+	if (val < 0)
+		return; /* clock has been stepped */
+
+	hist->buckets[latency_bucket(val)]++;
+	hist->count++;
+	hist->sum += val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+/* value below which the given fraction (in 1/1000) of the samples are */
+unsigned long long latency_percentile(struct latency_hist *hist, int permille) {
+	unsigned long long rank, seen = 0, limit;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (hist->count * permille + 999) / 1000;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			limit = latency_bucket_limit(i);
+			return (limit < hist->max) ? limit : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+void latency_rx(struct timeval *tv) {
+	latency_record(&conn_stats->rx_latency,
+		       now_ns(CLOCK_REALTIME) - (tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL));
+}
+
+void latency_command() {
+	command_time = now_ns(CLOCK_MONOTONIC);
+}
+
+void latency_tx() {
+	latency_record(&conn_stats->tx_latency, now_ns(CLOCK_MONOTONIC) - command_time);
+}
+
+static int latency_format(char *buf, char *name, struct latency_hist *hist) {
+	return sprintf(buf, " %s %llu %llu %llu %llu %llu", name, hist->count,
+		       latency_percentile(hist, 500),
+		       latency_percentile(hist, 990),
+		       latency_percentile(hist, 999),
+		       hist->max);
+}
+
+/* '< latency rx count p50 p99 p99.9 max tx count p50 p99 p99.9 max >' in ns */
+void latency_send() {
+	char buf[256];
+	int len;
+
+	len = sprintf(buf, "< latency");
+	len += latency_format(buf + len, "rx", &conn_stats->rx_latency);
+	len += latency_format(buf + len, "tx", &conn_stats->tx_latency);
+	len += sprintf(buf + len, " >");
+
+	client_send(buf, len, 0);
+}
+
+void latency_reset() {
+	memset(&conn_stats->rx_latency, 0, sizeof(conn_stats->rx_latency));
+	memset(&conn_stats->tx_latency, 0, sizeof(conn_stats->tx_latency));
+}
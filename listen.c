@@ -0,0 +1,527 @@
+#define _GNU_SOURCE /* CPU_SET() */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "listen.h"
+
+/*
+ * Listening sockets
+ *
+ * listen_addrs is a comma separated list of endpoints the daemon accepts
+ * connections on at the same time:
+ *
+ *   192.168.0.1:29536   IPv4 address and port
+ *   [::]:29536          IPv6 address and port (IPv6 only)
+ *   /run/socketcand     AF_UNIX path
+ *   unix:socketcand     AF_UNIX abstract name (or path with a leading '/')
+ *
+ * Without listen_addrs the daemon listens on the AF_UNIX name afuxname or
+ * the port on the address of the listen interface.
+ *
+ * With more than one acceptor the parent forks further acceptor processes.
+ * Each of them binds its own TCP sockets with SO_REUSEPORT, so the kernel
+ * spreads the incoming connections, and is pinned to a core. The parent with
+ * its threads stays unpinned and the connection processes and workers of an
+ * acceptor get the original affinity back with listen_unpin(). AF_UNIX
+ * sockets can not be sharded and are shared by all acceptors.
+ *
+ * Socket activation: a service manager like systemd passes the listening
+ * sockets from fd 3 on with LISTEN_PID and LISTEN_FDS in the environment.
+ * They replace the configured endpoints and are shared by the acceptors.
+ * listen_notify_ready() tells the manager on NOTIFY_SOCKET that connections
+ * are accepted (sd_notify(3) protocol, without libsystemd).
+ */
+
+char *listen_addrs;
+int listen_backlog = LISTEN_BACKLOG;
+int acceptors = 1;
+int listen_activated;
+
+static struct listener listeners[LISTEN_MAX];
+static cpu_set_t unpinned; /* affinity before listen_pin() */
+static int pinned;
+static int listen_count;
+static int next_listener; /* round robin over the ready sockets */
+
+static int listen_bind(struct listener *l) {
+	int fd, on = 1;
+
+	if((fd = socket(l->addr.ss_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if(l->addr.ss_family != AF_UNIX) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(acceptors > 1)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	}
+
+	/* '[::]' and '0.0.0.0' may be given both */
+	if(l->addr.ss_family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+
+	/* another acceptor may have taken the connection */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if(bind(fd, (struct sockaddr *) &l->addr, l->addrlen) < 0 || listen(fd, listen_backlog) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listen_unix(struct listener *l, const char *name) {
+	struct sockaddr_un *unaddr = (struct sockaddr_un *) &l->addr;
+
+	if(strlen(name) > sizeof(unaddr->sun_path)-3) {
+		PRINT_ERROR("afuxname is too long.\n");
+		return -1;
+	}
+
+	memset(unaddr, 0, sizeof(*unaddr));
+	unaddr->sun_family = AF_UNIX;
+
+	/* when the given name starts with a '/' we assume the path name scheme, e.g.
+	 * /var/run/socketcand or /tmp/socketcand-afunix-socket
+	 * Without the leading '/' we use the string as abstract socket address.
+	 */
+	if(name[0] == '/') {
+		strcpy(&unaddr->sun_path[0], name);
+		/* due to the trailing \0 in path name definition we can write the entire struct */
+		l->addrlen = sizeof(*unaddr);
+	} else {
+		strcpy(&unaddr->sun_path[1], name);
+		/* abtract name length definition without trailing \0 but with leading \0 */
+		l->addrlen = strlen(name) + sizeof(unaddr->sun_family) + 1;
+	}
+
+	return 0;
+}
+
+static int listen_inet(struct listener *l, const char *endpoint) {
+	struct addrinfo hints, *ai;
+	char host[INET6_ADDRSTRLEN + 2];
+	const char *service;
+	int len, ret;
+
+	/* the port follows the last ':' - IPv6 addresses are enclosed in '[]' */
+	if((service = strrchr(endpoint, ':')) == NULL || service == endpoint) {
+		PRINT_ERROR("Invalid listen address '%s'\n", endpoint);
+		return -1;
+	}
+
+	len = service - endpoint;
+	if(endpoint[0] == '[' && endpoint[len-1] == ']') {
+		endpoint++;
+		len -= 2;
+	}
+
+	if(len <= 0 || len >= (int) sizeof(host)) {
+		PRINT_ERROR("Invalid listen address '%s'\n", endpoint);
+		return -1;
+	}
+	memcpy(host, endpoint, len);
+	host[len] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+	if((ret = getaddrinfo(host, service + 1, &hints, &ai))) {
+		PRINT_ERROR("Invalid listen address '%s' %s\n", endpoint, gai_strerror(ret));
+		return -1;
+	}
+
+	memcpy(&l->addr, ai->ai_addr, ai->ai_addrlen);
+	l->addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	return 0;
+}
+
+static int listen_add(const char *endpoint) {
+	struct listener *l;
+	int ret;
+
+	if(listen_count == LISTEN_MAX) {
+		PRINT_ERROR("More than %d listen addresses\n", LISTEN_MAX);
+		return -1;
+	}
+
+	l = &listeners[listen_count];
+	memset(l, 0, sizeof(*l));
+
+	if(endpoint[0] == '/')
+		ret = listen_unix(l, endpoint);
+	else if(!strncmp(endpoint, "unix:", 5))
+		ret = listen_unix(l, endpoint + 5);
+	else
+		ret = listen_inet(l, endpoint);
+
+	if(ret < 0)
+		return -1;
+
+	PRINT_VERBOSE("binding socket to '%s'\n", endpoint);
+	if((l->fd = listen_bind(l)) < 0) {
+		PRINT_ERROR("Could not listen on '%s' %s\n", endpoint, strerror(errno));
+		return -1;
+	}
+
+	listen_count++;
+	return 0;
+}
+
+/* takes over the sockets of the service manager - returns their number */
+int listen_inherit() {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	struct listener *l;
+	socklen_t len;
+	int i, n, type, accepting;
+
+	if(pid == NULL || fds == NULL || atoi(pid) != getpid())
+		return 0;
+
+	n = atoi(fds);
+
+	/* not for the processes we fork */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if(n <= 0)
+		return 0;
+
+	if(n > LISTEN_MAX) {
+		PRINT_ERROR("Using %d of %d passed sockets\n", LISTEN_MAX, n);
+		n = LISTEN_MAX;
+	}
+
+	for(i=0;i<n;i++) {
+		l = &listeners[i];
+		memset(l, 0, sizeof(*l));
+		l->fd = LISTEN_FDS_START + i;
+		l->addrlen = sizeof(l->addr);
+		l->inherited = 1;
+
+		if(getsockname(l->fd, (struct sockaddr *) &l->addr, &l->addrlen) < 0) {
+			PRINT_ERROR("Passed socket %d is invalid %s\n", l->fd, strerror(errno));
+			exit(1);
+		}
+
+		/* like sd_is_socket(fd, AF_UNSPEC, SOCK_STREAM, 1) - e.g. not Accept=yes */
+		len = sizeof(type);
+		if(getsockopt(l->fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM) {
+			PRINT_ERROR("Passed socket %d is no stream socket\n", l->fd);
+			exit(1);
+		}
+
+		len = sizeof(accepting);
+		if(getsockopt(l->fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0 || !accepting) {
+			PRINT_ERROR("Passed socket %d is not listening (Accept=yes is not supported)\n", l->fd);
+			exit(1);
+		}
+
+		fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	PRINT_VERBOSE("using %d sockets of the service manager\n", n);
+
+	listen_count = n;
+	listen_activated = 1;
+	return n;
+}
+
+/* opens the configured endpoints - returns -1 when one of them failed */
+int listen_open() {
+	char *addrs, *endpoint, *save;
+	struct listener *l;
+	int ret = 0;
+
+	if(listen_addrs == NULL) {
+		l = &listeners[0];
+		memset(l, 0, sizeof(*l));
+
+		if(afuxname) {
+			if(listen_unix(l, afuxname) < 0)
+				return -1;
+			PRINT_VERBOSE("binding unix socket to '%s' with unaddrlen %d\n", afuxname, l->addrlen);
+		} else {
+			memcpy(&l->addr, &saddr, sizeof(saddr));
+			l->addrlen = sizeof(saddr);
+			PRINT_VERBOSE("binding socket to %s:%d\n", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
+		}
+
+		if((l->fd = listen_bind(l)) < 0) {
+			PRINT_ERROR("Could not listen %s\n", strerror(errno));
+			return -1;
+		}
+
+		listen_count = 1;
+		return 0;
+	}
+
+	addrs = strdup(listen_addrs);
+	for(endpoint = strtok_r(addrs, ",", &save); endpoint; endpoint = strtok_r(NULL, ",", &save)) {
+		if(listen_add(endpoint) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	free(addrs);
+
+	return ret;
+}
+
+static void listen_pin(int core) {
+	cpu_set_t set;
+
+	if(sched_getaffinity(0, sizeof(unpinned), &unpinned) < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+		PRINT_ERROR("Could not pin acceptor to core %d %s\n", core, strerror(errno));
+	} else {
+		pinned = 1;
+	}
+}
+
+/* a forked connection process or worker may run on every core again */
+void listen_unpin() {
+	if(pinned && sched_setaffinity(0, sizeof(unpinned), &unpinned) == 0)
+		pinned = 0;
+}
+
+/*
+ * Forks the further acceptors - returns the number of the acceptor in the
+ * calling process (0 in the parent).
+ */
+int listen_acceptors() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	pid_t pid;
+	int i, j;
+
+	if(acceptors <= 1)
+		return 0;
+
+	if(cores < 1)
+		cores = 1;
+
+	for(i=1;i<acceptors;i++) {
+		pid = fork();
+
+		if(pid < 0) {
+			PRINT_ERROR("Could not fork acceptor %s\n", strerror(errno));
+			break;
+		}
+
+		if(pid > 0)
+			continue;
+
+		/* the acceptors end with the parent */
+		prctl(PR_SET_PDEATHSIG, SIGINT);
+
+		/* only the main process may notify the service manager (NotifyAccess=main) */
+		unsetenv("NOTIFY_SOCKET");
+
+		/* own TCP sockets in the SO_REUSEPORT group of the parent */
+		for(j=0;j<listen_count;j++) {
+			if(listeners[j].addr.ss_family == AF_UNIX || listeners[j].inherited)
+				continue;
+
+			close(listeners[j].fd);
+			if((listeners[j].fd = listen_bind(&listeners[j])) < 0) {
+				PRINT_ERROR("Acceptor %d could not listen %s\n", i, strerror(errno));
+				exit(1);
+			}
+		}
+
+		listen_pin(i % cores);
+		return i;
+	}
+
+	/* the parent is not pinned - its threads may be started later */
+	return 0;
+}
+
+/*
+ * Waits for a connection on one of the sockets - returns -1 with EAGAIN when
+ * it was taken and with EINTR when wake_fd (if >= 0) became readable.
+ */
+int listen_accept(int wake_fd) {
+	struct pollfd pfd[LISTEN_MAX + 1];
+	int i, n, fd, flag;
+
+	for(i=0;i<listen_count;i++) {
+		pfd[i].fd = listeners[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	pfd[listen_count].fd = wake_fd;
+	pfd[listen_count].events = POLLIN;
+	pfd[listen_count].revents = 0;
+
+	if(poll(pfd, listen_count + 1, -1) < 0)
+		return -1;
+
+	if(pfd[listen_count].revents & POLLIN) {
+		errno = EINTR;
+		return -1;
+	}
+
+	for(n=0;n<listen_count;n++) {
+		i = (next_listener + n) % listen_count;
+		if(!(pfd[i].revents & POLLIN))
+			continue;
+
+		next_listener = i + 1;
+
+		if((fd = accept(listeners[i].fd, NULL, NULL)) < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+				continue;
+			return -1;
+		}
+
+		if(listeners[i].addr.ss_family != AF_UNIX) {
+			flag = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+		}
+
+		return fd;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+void listen_close() {
+	int i;
+
+	for(i=0;i<listen_count;i++) {
+		if(listeners[i].fd >= 0)
+			close(listeners[i].fd);
+		listeners[i].fd = -1;
+	}
+}
+
+/* READY=1 to the service manager when it asked for it */
+void listen_notify_ready() {
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int fd;
+
+	if(path == NULL || (path[0] != '/' && path[0] != '@') ||
+	   strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	/* '@' denotes an abstract name */
+	if(path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	if((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return;
+
+	if(sendto(fd, "READY=1", 7, 0, (struct sockaddr *) &addr, addrlen) < 0) {
+		PRINT_ERROR("Could not notify the service manager %s\n", strerror(errno));
+	}
+
+	close(fd);
+	unsetenv("NOTIFY_SOCKET");
+}
+
+/* first address of the family on the listen interface - for wildcard endpoints */
+static int listen_local(int family, void *addr) {
+	struct ifaddrs *ifa, *list;
+	int found = 0;
+
+	if(getifaddrs(&list) < 0)
+		return 0;
+
+	for(ifa = list; ifa && !found; ifa = ifa->ifa_next) {
+		if(ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != family ||
+		   strcmp(ifa->ifa_name, interface_string))
+			continue;
+
+		if(family == AF_INET) {
+			memcpy(addr, &((struct sockaddr_in *) ifa->ifa_addr)->sin_addr, sizeof(struct in_addr));
+			found = 1;
+		} else if(!IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr)) {
+			/* a link-local address is of no use without the scope */
+			memcpy(addr, &((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr, sizeof(struct in6_addr));
+			found = 1;
+		}
+	}
+
+	freeifaddrs(list);
+	return found;
+}
+
+/*
+ * URL 'can://host:port' of listening socket i for the beacon. Returns -1
+ * after the last socket and 0 for sockets without URL: AF_UNIX and wildcard
+ * addresses without an address of their family on the listen interface.
+ */
+int listen_url(int i, char *buf, int len) {
+	struct sockaddr_storage *ss;
+	struct in_addr in;
+	struct in6_addr in6;
+	char host[INET6_ADDRSTRLEN];
+
+	if(i >= listen_count)
+		return -1;
+
+	ss = &listeners[i].addr;
+
+	if(ss->ss_family == AF_INET) {
+		in = ((struct sockaddr_in *) ss)->sin_addr;
+		if(in.s_addr == htonl(INADDR_ANY) && !listen_local(AF_INET, &in))
+			return 0;
+
+		inet_ntop(AF_INET, &in, host, sizeof(host));
+		snprintf(buf, len, "can://%s:%d", host, ntohs(((struct sockaddr_in *) ss)->sin_port));
+		return 1;
+	}
+
+	if(ss->ss_family == AF_INET6) {
+		in6 = ((struct sockaddr_in6 *) ss)->sin6_addr;
+		if(IN6_IS_ADDR_UNSPECIFIED(&in6) && !listen_local(AF_INET6, &in6))
+			return 0;
+
+		inet_ntop(AF_INET6, &in6, host, sizeof(host));
+		snprintf(buf, len, "can://[%s]:%d", host, ntohs(((struct sockaddr_in6 *) ss)->sin6_port));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#define LISTEN_MAX 16
+#define LISTEN_BACKLOG 128
+#define LISTEN_FDS_START 3 /* SD_LISTEN_FDS_START */
+
+/* a listening socket of the daemon */
+struct listener {
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int inherited; /* passed by the service manager */
+};
+
+extern char *listen_addrs;
+extern int listen_backlog;
+extern int acceptors;
+extern int listen_activated;
+
+int listen_inherit();
+int listen_open();
+int listen_acceptors();
+int listen_accept(int wake_fd);
+void listen_close();
+void listen_unpin();
+void listen_notify_ready();
+int listen_url(int i, char *buf, int len);
@@ -0,0 +1,332 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+
+/*
+ * Asynchronous logging
+ *
+ * PRINT_INFO() and PRINT_ERROR() only format the message into a ring and
+ * return, a writer thread of the process passes the lines to syslog() or
+ * stdout/stderr. Slots of the ring are claimed with a compare and swap, so
+ * the threads of the parent and signal handlers may log concurrently
+ * without a lock.
+ *
+ * A process logs at most LOG_RATE lines per second (unlimited with -v),
+ * lines beyond that and lines that do not fit into the full ring are
+ * dropped and counted. Identical consecutive lines are written once and
+ * summarized with 'last message repeated n times'. Both summaries are
+ * written at most every LOG_SUMMARY_MS.
+ *
+ * A signal handler calls log_signal() before it logs: its lines are only
+ * inserted into the ring and the writer is woken with eventfd_write(). It
+ * never starts the writer or drains the ring itself, and log_flush() from a
+ * handler gives up when the lock is not released within LOG_SIGNAL_TRIES ms.
+ *
+ * Threads do not survive fork(): the child discards the lines inherited from
+ * the parent and starts its own writer with the first line it logs.
+ */
+
+#define LOG_SLOTS 256 /* power of 2 */
+#define LOG_LINE 256
+#define LOG_RATE 100
+#define LOG_SUMMARY_MS 1000
+#define LOG_WRITER_STACK (64 * 1024)
+#define LOG_SIGNAL_TRIES 100 /* ms a handler waits for the drain_lock */
+
+struct log_entry {
+	unsigned int seq; /* slot is free for position seq, filled for seq - 1 */
+	int priority;
+	char text[LOG_LINE];
+};
+
+static struct log_entry ring[LOG_SLOTS];
+static unsigned int ring_head; /* next position of the producers */
+static unsigned int ring_tail; /* next position of the writer */
+
+static unsigned long suppressed, suppressed_reported;
+static long rate_second;
+static unsigned int rate_lines;
+
+static int writer_state; /* 0: not started, 1: running, 2: starting, -1: write synchronously */
+static int log_event = -1;
+static __thread volatile sig_atomic_t in_signal; /* the thread runs a signal handler */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* owned by the drain_lock */
+static char last_text[LOG_LINE];
+static int last_priority = -1;
+static unsigned int repeated;
+static long long repeated_since, suppressed_since;
+
+static long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void log_reset() {
+	unsigned int i;
+
+	for(i=0;i<LOG_SLOTS;i++)
+		ring[i].seq = i;
+	ring_head = ring_tail = 0;
+}
+
+/* the lines inherited from the parent are written by the parent */
+static void log_forked() {
+	pthread_mutex_init(&drain_lock, NULL);
+	log_reset();
+	if(log_event >= 0)
+		close(log_event);
+	log_event = -1;
+	writer_state = 0;
+	repeated = 0;
+	last_priority = -1;
+	suppressed = suppressed_reported = suppressed_since = 0;
+	rate_lines = 0;
+}
+
+static void log_write(int priority, const char *text) {
+	if(daemon_flag) {
+		syslog(priority, "%s", text);
+	} else if(priority <= LOG_ERR) {
+		fputs(text, stderr);
+	} else {
+		fputs(text, stdout);
+		fflush(stdout);
+	}
+}
+
+static void log_repeated() {
+	char text[64];
+
+	snprintf(text, sizeof(text), "last message repeated %u times\n", repeated);
+	log_write(last_priority, text);
+	repeated = 0;
+}
+
+/* writes the summaries that are due - returns 1 when some are left for later */
+static int log_summary(int force) {
+	char text[64];
+	unsigned long count = __atomic_load_n(&suppressed, __ATOMIC_RELAXED);
+	long long now = now_ms();
+
+	if(repeated && (force || now - repeated_since >= LOG_SUMMARY_MS))
+		log_repeated();
+
+	if(count != suppressed_reported) {
+		if(!suppressed_since)
+			suppressed_since = now;
+
+		if(force || now - suppressed_since >= LOG_SUMMARY_MS) {
+			snprintf(text, sizeof(text), "%lu log messages suppressed\n", count - suppressed_reported);
+			log_write(LOG_WARNING, text);
+			suppressed_reported = count;
+			suppressed_since = 0;
+			conn_stats->log_suppressed = count;
+		}
+	}
+
+	return repeated || count != suppressed_reported;
+}
+
+/* writes the lines of the ring - returns 1 when summaries are pending */
+static int log_drain(int force) {
+	struct log_entry *entry;
+	int pending;
+
+	if(in_signal) {
+		/* the writer releases it soon, the interrupted code never */
+		struct timespec ms = { 0, 1000000 };
+		int tries = 0;
+
+		while(pthread_mutex_trylock(&drain_lock)) {
+			if(++tries >= LOG_SIGNAL_TRIES)
+				return 1;
+			nanosleep(&ms, NULL);
+		}
+	} else {
+		pthread_mutex_lock(&drain_lock);
+	}
+
+	for(;;) {
+		entry = &ring[ring_tail & (LOG_SLOTS - 1)];
+		if(__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+			break;
+
+		if(entry->priority == last_priority && !strcmp(entry->text, last_text)) {
+			if(!repeated++)
+				repeated_since = now_ms();
+		} else {
+			/* the repetitions end before the next line */
+			if(repeated)
+				log_repeated();
+			log_write(entry->priority, entry->text);
+			last_priority = entry->priority;
+			strcpy(last_text, entry->text);
+		}
+
+		__atomic_store_n(&entry->seq, ring_tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		ring_tail++;
+	}
+
+	pending = log_summary(force);
+
+	pthread_mutex_unlock(&drain_lock);
+
+	return pending;
+}
+
+static void *log_writer(void *arg) {
+	struct pollfd pfd;
+	eventfd_t val;
+	int pending;
+
+	pfd.fd = log_event;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		/* lines logged while the writer was starting are pending as well */
+		pending = log_drain(0);
+
+		if(poll(&pfd, 1, pending ? LOG_SUMMARY_MS : -1) > 0)
+			eventfd_read(log_event, &val);
+	}
+
+	return NULL;
+}
+
+static void log_start() {
+	pthread_attr_t attr;
+	pthread_t writer;
+	sigset_t sigset, oldset;
+	int expected = 0;
+
+	if(!__atomic_compare_exchange_n(&writer_state, &expected, 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+
+	if((log_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		__atomic_store_n(&writer_state, -1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, LOG_WRITER_STACK);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* signal handlers may log and must not interrupt the drain */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	if(pthread_create(&writer, &attr, &log_writer, NULL)) {
+		close(log_event);
+		log_event = -1;
+		__atomic_store_n(&writer_state, -1, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&writer_state, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/* lines of the current second or 0 when the rate is exceeded */
+static int log_rate() {
+	long second = now_ms() / 1000;
+	long seen = __atomic_load_n(&rate_second, __ATOMIC_RELAXED);
+
+	if(verbose_flag)
+		return 1;
+
+	if(seen != second && __atomic_compare_exchange_n(&rate_second, &seen, second, 0,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&rate_lines, 0, __ATOMIC_RELAXED);
+
+	return __atomic_fetch_add(&rate_lines, 1, __ATOMIC_RELAXED) < LOG_RATE;
+}
+
+void log_message(int priority, const char *fmt, ...) {
+	struct log_entry *entry;
+	unsigned int pos, seq;
+	va_list ap;
+	int len, state, fd;
+
+	if(!log_rate()) {
+		__atomic_fetch_add(&suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for(;;) {
+		entry = &ring[pos & (LOG_SLOTS - 1)];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+		if(seq == pos) {
+			if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+						       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if((int) (seq - pos) < 0) {
+			/* full - the writer did not keep up */
+			__atomic_fetch_add(&suppressed, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(entry->text, LOG_LINE, fmt, ap);
+	va_end(ap);
+
+	if(len >= LOG_LINE)
+		entry->text[LOG_LINE - 2] = '\n';
+
+	entry->priority = priority;
+	__atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* a signal handler leaves the line to the writer or the next caller */
+	state = __atomic_load_n(&writer_state, __ATOMIC_ACQUIRE);
+	if(state == 0 && !in_signal) {
+		log_start();
+		state = __atomic_load_n(&writer_state, __ATOMIC_ACQUIRE);
+	}
+
+	if(state < 0) {
+		if(!in_signal)
+			log_drain(0);
+	} else if((fd = __atomic_load_n(&log_event, __ATOMIC_ACQUIRE)) >= 0)
+		eventfd_write(fd, 1);
+}
+
+/* the calling thread runs a signal handler that does not return */
+void log_signal() {
+	in_signal = 1;
+}
+
+/* writes everything that is pending - e.g. before the process exits */
+void log_flush() {
+	log_drain(1);
+}
+
+void log_init() {
+	log_reset();
+	pthread_atfork(NULL, NULL, &log_forked);
+	atexit(&log_flush);
+}
@@ -0,0 +1,610 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "statistics.h"
+#include "metrics.h"
+
+/*
+ * OpenMetrics exporter
+ *
+ * Every connection process writes its counters (struct conn_stats) into a
+ * slot of an anonymous shared mapping that is created before the first
+ * fork. The slots are written without locking by their connection process
+ * and only read by the exporter thread of the parent when it is scraped.
+ * When a connection process has been reaped its counters are added to the
+ * totals of the finished connections before the slot is released. Both
+ * happen under shm->lock and a scrape copies the totals and the slots under
+ * the same lock, so the exported daemon-wide counters never go backwards.
+ */
+
+char *metrics_addr = NULL;
+
+static struct metrics_shm *shm;
+static struct client_slot *own_slot; /* slot of this connection process */
+static int metrics_socket = -1;
+static pthread_t metrics_thread;
+
+static const char *state_names[] = { "none", "bcm", "raw", "shutdown", "control", "isotp" };
+
+/* exported counters of struct conn_stats */
+struct metrics_counter {
+	const char *name;
+	const char *help;
+	size_t offset;
+	int ns; /* exported in seconds */
+};
+
+static const struct metrics_counter counters[] = {
+	{ "client_rx_bytes", "Bytes received from the clients", offsetof(struct conn_stats, client_rx_bytes), 0 },
+	{ "client_tx_bytes", "Bytes sent to the clients", offsetof(struct conn_stats, client_tx_bytes), 0 },
+	{ "can_rx_frames", "CAN frames and PDUs forwarded to the clients", offsetof(struct conn_stats, can_rx), 0 },
+	{ "can_tx_frames", "CAN frames and PDUs sent to the bus", offsetof(struct conn_stats, can_tx), 0 },
+	{ "commands", "Command elements received from the clients", offsetof(struct conn_stats, commands), 0 },
+	{ "parse_errors", "Malformed or unknown commands", offsetof(struct conn_stats, parse_errors), 0 },
+	{ "can_tx_errors", "Failed writes to the bus", offsetof(struct conn_stats, can_tx_errors), 0 },
+	{ "can_drops", "Frames dropped by the kernel in RAW mode", offsetof(struct conn_stats, can_drops), 0 },
+	{ "send_blocked_seconds", "Time spent in send() to the clients", offsetof(struct conn_stats, send_blocked_ns), 1 },
+	{ "log_suppressed_lines", "Log lines dropped by the rate limit", offsetof(struct conn_stats, log_suppressed), 0 },
+};
+
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static unsigned long long counter_value(struct conn_stats *stats, const struct metrics_counter *c) {
+	return *(unsigned long long *) ((char *) stats + c->offset);
+}
+
+static void hist_add(struct latency_hist *dst, struct latency_hist *src) {
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static void conn_stats_add(struct conn_stats *dst, struct conn_stats *src) {
+	dst->client_rx_bytes += src->client_rx_bytes;
+	dst->client_tx_bytes += src->client_tx_bytes;
+	dst->can_rx += src->can_rx;
+	dst->can_tx += src->can_tx;
+	dst->commands += src->commands;
+	dst->parse_errors += src->parse_errors;
+	dst->can_tx_errors += src->can_tx_errors;
+	dst->can_drops += src->can_drops;
+	dst->send_blocked_ns += src->send_blocked_ns;
+	dst->log_suppressed += src->log_suppressed;
+	if (src->outq_max > dst->outq_max)
+		dst->outq_max = src->outq_max;
+	hist_add(&dst->rx_latency, &src->rx_latency);
+	hist_add(&dst->tx_latency, &src->tx_latency);
+}
+
+/* creates the shared mapping - has to be called before the first fork */
+void metrics_init() {
+	pthread_mutexattr_t attr;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		PRINT_ERROR("Could not map the connection counters %s\n", strerror(errno));
+		shm = NULL;
+		return;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	/* a worker may die holding it, e.g. by the SIGINT of its acceptor */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void metrics_lock() {
+	/* the owner died in between - at worst the slot it claimed stays reserved */
+	if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&shm->lock);
+}
+
+/*
+ * Reserves a slot for a new connection. Called by the accepting process,
+ * returns NULL when all slots are in use.
+ */
+struct client_slot *metrics_claim() {
+	struct client_slot *slot = NULL;
+	int i;
+
+	if (shm == NULL)
+		return NULL;
+
+	metrics_lock();
+
+	shm->connections++;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (shm->clients[i].pid == 0) {
+			slot = &shm->clients[i];
+			memset(slot, 0, sizeof(*slot));
+			slot->pid = -1;
+			slot->conn = shm->connections;
+			break;
+		}
+	}
+
+	if (slot == NULL)
+		shm->untracked++;
+
+	pthread_mutex_unlock(&shm->lock);
+	return slot;
+}
+
+/* parent: the connection process has been forked (pid < 0: fork failed) */
+void metrics_forked(struct client_slot *slot, pid_t pid) {
+	if (shm && pid < 0)
+		shm->fork_errors++;
+
+	if (slot)
+		slot->pid = (pid < 0) ? 0 : pid;
+}
+
+/* connection process: count into the slot */
+void metrics_child(struct client_slot *slot) {
+	if (metrics_socket >= 0)
+		close(metrics_socket);
+	metrics_socket = -1;
+
+	own_slot = slot;
+	if (slot)
+		conn_stats = &slot->stats;
+}
+
+/* publishes the statistics interval of this connection for the collector */
+void metrics_client_ival(int ival) {
+	if (own_slot == NULL || own_slot->stat_ival == ival)
+		return;
+
+	own_slot->stat_ival = ival;
+	statistics_collector_wake();
+}
+
+/* shortest statistics interval of the connections in ms or 0 if there is none */
+int metrics_min_ival() {
+	int i, ival = 0;
+
+	if (shm == NULL)
+		return 0;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (shm->clients[i].pid > 0 && shm->clients[i].stat_ival > 0 &&
+		    (ival == 0 || shm->clients[i].stat_ival < ival))
+			ival = shm->clients[i].stat_ival;
+	}
+
+	return ival;
+}
+
+/* connections on the bus (all connections with NULL) or -1 when unknown */
+int metrics_clients(const char *bus) {
+	int i, n = 0;
+
+	if (shm == NULL)
+		return -1;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (shm->clients[i].pid != 0 && (bus == NULL || !strcmp(shm->clients[i].bus_name, bus)))
+			n++;
+	}
+
+	return n;
+}
+
+/* publishes the bus and the mode of this connection */
+void metrics_client_update() {
+	if (own_slot == NULL)
+		return;
+
+	strcpy(own_slot->bus_name, bus_name);
+	own_slot->state = state;
+}
+
+/* called by reap_children() for every reaped process */
+void metrics_reaped(pid_t pid) {
+	int i;
+
+	if (shm == NULL)
+		return;
+
+	metrics_lock();
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (shm->clients[i].pid == pid) {
+			conn_stats_add(&shm->finished, &shm->clients[i].stats);
+			shm->clients[i].pid = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&shm->lock);
+}
+
+/* worker of the pool: the connection has ended, the slot is given back */
+void metrics_release() {
+	if (own_slot)
+		metrics_reaped(own_slot->pid);
+	own_slot = NULL;
+}
+
+/* the exposition is collected in a growing buffer */
+static char *out_buf;
+static int out_len, out_size;
+
+static void out(const char *fmt, ...) {
+	va_list ap;
+	int len, size;
+	char *tmp;
+
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(out_buf + out_len, out_size - out_len, fmt, ap);
+		va_end(ap);
+
+		if (len < out_size - out_len) {
+			out_len += len;
+			return;
+		}
+
+		size = 2 * out_size + len + 1;
+		tmp = realloc(out_buf, size);
+		if (tmp == NULL)
+			return;
+		out_buf = tmp;
+		out_size = size;
+	}
+}
+
+static void out_family(const char *name, const char *type, const char *help) {
+	out("# TYPE %s %s\n# HELP %s %s.\n", name, type, name, help);
+}
+
+static void out_bus() {
+	static const struct {
+		const char *name;
+		const char *help;
+		size_t offset;
+	} bus_counters[] = {
+		{ "rx_frames", "Frames received on the bus", offsetof(struct rtnl_link_stats64, rx_packets) },
+		{ "tx_frames", "Frames sent on the bus", offsetof(struct rtnl_link_stats64, tx_packets) },
+		{ "rx_bytes", "Data bytes received on the bus", offsetof(struct rtnl_link_stats64, rx_bytes) },
+		{ "tx_bytes", "Data bytes sent on the bus", offsetof(struct rtnl_link_stats64, tx_bytes) },
+		{ "rx_errors", "Receive errors of the CAN interface", offsetof(struct rtnl_link_stats64, rx_errors) },
+		{ "tx_errors", "Transmit errors of the CAN interface", offsetof(struct rtnl_link_stats64, tx_errors) },
+		{ "rx_dropped", "Frames dropped by the CAN interface", offsetof(struct rtnl_link_stats64, rx_dropped) },
+	};
+	struct rtnl_link_stats64 stats[interface_count];
+	struct busload load[interface_count];
+	int valid[interface_count];
+	int i, j;
+
+	/* published by the statistics collector */
+	for (i = 0; i < interface_count; i++)
+		valid[i] = (statistics_snapshot(i, &stats[i], &load[i], 0) == 0);
+
+	for (j = 0; j < sizeof(bus_counters) / sizeof(bus_counters[0]); j++) {
+		out("# TYPE socketcand_bus_%s counter\n# HELP socketcand_bus_%s %s.\n",
+		    bus_counters[j].name, bus_counters[j].name, bus_counters[j].help);
+
+		for (i = 0; i < interface_count; i++) {
+			if (valid[i])
+				out("socketcand_bus_%s_total{bus=\"%s\"} %llu\n", bus_counters[j].name,
+				    interface_names[i],
+				    *(__u64 *) ((char *) &stats[i] + bus_counters[j].offset));
+		}
+	}
+
+	out_family("socketcand_bus_load_percent", "gauge", "Estimated bus load");
+	for (i = 0; i < interface_count; i++) {
+		if (valid[i] && load[i].load1 >= 0) {
+			out("socketcand_bus_load_percent{bus=\"%s\",window=\"1s\"} %.2f\n", interface_names[i], load[i].load1);
+			out("socketcand_bus_load_percent{bus=\"%s\",window=\"10s\"} %.2f\n", interface_names[i], load[i].load10);
+		}
+	}
+
+	out_family("socketcand_bus_frames_per_second", "gauge", "Frames per second on the bus");
+	for (i = 0; i < interface_count; i++) {
+		if (valid[i]) {
+			out("socketcand_bus_frames_per_second{bus=\"%s\",window=\"1s\"} %.1f\n", interface_names[i], load[i].fps1);
+			out("socketcand_bus_frames_per_second{bus=\"%s\",window=\"10s\"} %.1f\n", interface_names[i], load[i].fps10);
+		}
+	}
+}
+
+static void out_counter_value(const char *name, const char *labels,
+			      struct conn_stats *stats, const struct metrics_counter *c) {
+	unsigned long long val = counter_value(stats, c);
+
+	if (c->ns)
+		out("%s_total%s %llu.%09llu\n", name, labels, val / 1000000000ULL, val % 1000000000ULL);
+	else
+		out("%s_total%s %llu\n", name, labels, val);
+}
+
+static void out_histogram(const char *name, const char *help, struct latency_hist *hist) {
+	unsigned long long cumulative = 0;
+	int i = 0, exp;
+
+	out_family(name, "histogram", help);
+
+	for (exp = METRICS_LAT_MIN_EXP; exp <= METRICS_LAT_MAX_EXP; exp += 2) {
+		/* the buckets end exactly at the powers of two */
+		for (; i < LAT_BUCKETS && latency_bucket_limit(i) < (1ULL << exp); i++)
+			cumulative += hist->buckets[i];
+
+		out("%s_bucket{le=\"%.9f\"} %llu\n", name, (double) (1ULL << exp) / 1e9, cumulative);
+	}
+
+	out("%s_bucket{le=\"+Inf\"} %llu\n", name, hist->count);
+	out("%s_count %llu\n", name, hist->count);
+	out("%s_sum %llu.%09llu\n", name, hist->sum / 1000000000ULL, hist->sum % 1000000000ULL);
+}
+
+static void metrics_collect() {
+	static struct conn_stats total;
+	static struct client_slot slots[METRICS_MAX_CLIENTS];
+	struct client_slot *slot;
+	char name[64], labels[96 + MAX_BUSNAME];
+	int i, j, clients = 0;
+
+	out_len = 0;
+
+	/* a reaped connection moves from its slot to the finished ones in between */
+	metrics_lock();
+	memcpy(&total, &shm->finished, sizeof(total));
+	memcpy(slots, shm->clients, sizeof(slots));
+	pthread_mutex_unlock(&shm->lock);
+
+	/* daemon-wide sums of the finished and the running connections */
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (slots[i].pid > 0) {
+			conn_stats_add(&total, &slots[i].stats);
+			clients++;
+		}
+	}
+
+	out_family("socketcand_connections", "counter", "Accepted client connections");
+	out("socketcand_connections_total %llu\n", shm->connections);
+	out_family("socketcand_fork_errors", "counter", "Connections that could not be forked");
+	out("socketcand_fork_errors_total %llu\n", shm->fork_errors);
+	out_family("socketcand_untracked_connections", "counter", "Connections without a statistics slot");
+	out("socketcand_untracked_connections_total %llu\n", shm->untracked);
+	out_family("socketcand_clients", "gauge", "Connected clients");
+	out("socketcand_clients %d\n", clients);
+
+	out_bus();
+
+	for (j = 0; j < NCOUNTERS; j++) {
+		sprintf(name, "socketcand_%s", counters[j].name);
+		out_family(name, "counter", counters[j].help);
+		out_counter_value(name, "", &total, &counters[j]);
+	}
+
+	/* per connection */
+	for (j = 0; j < NCOUNTERS; j++) {
+		sprintf(name, "socketcand_conn_%s", counters[j].name);
+		out_family(name, "counter", counters[j].help);
+
+		for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+			slot = &slots[i];
+			if (slot->pid <= 0)
+				continue;
+
+			snprintf(labels, sizeof(labels), "{conn=\"%llu\",pid=\"%d\",bus=\"%.*s\",mode=\"%s\"}",
+				 slot->conn, slot->pid, MAX_BUSNAME - 1, slot->bus_name,
+				 (slot->state >= 0 && slot->state <= STATE_ISOTP) ? state_names[slot->state] : "none");
+			out_counter_value(name, labels, &slot->stats, &counters[j]);
+		}
+	}
+
+	out_family("socketcand_conn_outq_max_bytes", "gauge", "High-water mark of the send queue to the client");
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		slot = &slots[i];
+		if (slot->pid > 0)
+			out("socketcand_conn_outq_max_bytes{conn=\"%llu\",pid=\"%d\"} %llu\n",
+			    slot->conn, slot->pid, slot->stats.outq_max);
+	}
+
+	out_histogram("socketcand_rx_latency_seconds", "Latency from the reception on the bus to the client",
+		      &total.rx_latency);
+	out_histogram("socketcand_tx_latency_seconds", "Latency from the client command to the bus",
+		      &total.tx_latency);
+
+	out("# EOF\n");
+}
+
+static int write_all(int fd, const char *data, int len) {
+	int ret;
+
+	while (len > 0) {
+		ret = send(fd, data, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* answers a single HTTP request and closes the connection */
+static void metrics_serve(int fd) {
+	char req[METRICS_REQUEST_LEN + 1], head[256];
+	struct timeval timeout;
+	int len = 0, ret;
+
+	timeout.tv_sec = METRICS_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	/* only the request line matters, wait for the end of the header */
+	while (len < METRICS_REQUEST_LEN) {
+		ret = recv(fd, req + len, METRICS_REQUEST_LEN - len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[len] = '\0';
+
+	if (strncmp(req, "GET ", 4)) {
+		strcpy(head, "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n");
+		write_all(fd, head, strlen(head));
+		return;
+	}
+
+	metrics_collect();
+
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		 "Content-Length: %d\r\nConnection: close\r\n\r\n", out_len);
+
+	if (write_all(fd, head, strlen(head)) == 0)
+		write_all(fd, out_buf, out_len);
+}
+
+static void *metrics_loop(void *ptr) {
+	int fd;
+
+	while (1) {
+		fd = accept(metrics_socket, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			PRINT_ERROR("Error in metrics accept() %s\n", strerror(errno));
+			break;
+		}
+
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * metrics_addr is either a TCP port on the listen address of the daemon or
+ * an AF_UNIX name with the same rules as afuxname.
+ */
+static int metrics_listen() {
+	struct sockaddr_in inaddr;
+	struct sockaddr_un unaddr;
+	socklen_t addrlen;
+	int fd, i, numeric = 1;
+
+	for (i = 0; metrics_addr[i]; i++) {
+		if (!isdigit((unsigned char) metrics_addr[i]))
+			numeric = 0;
+	}
+
+	if (numeric) {
+		if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+
+		i = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+
+		inaddr = saddr;
+		inaddr.sin_port = htons(atoi(metrics_addr));
+		if (bind(fd, (struct sockaddr *) &inaddr, sizeof(inaddr)) < 0) {
+			close(fd);
+			return -1;
+		}
+	} else {
+		if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+
+		if (strlen(metrics_addr) > sizeof(unaddr.sun_path) - 3) {
+			close(fd);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memset(&unaddr, 0, sizeof(unaddr));
+		unaddr.sun_family = AF_UNIX;
+		if (metrics_addr[0] == '/') {
+			strcpy(&unaddr.sun_path[0], metrics_addr);
+			addrlen = sizeof(unaddr);
+		} else {
+			/* abstract name */
+			strcpy(&unaddr.sun_path[1], metrics_addr);
+			addrlen = strlen(metrics_addr) + sizeof(unaddr.sun_family) + 1;
+		}
+
+		if (bind(fd, (struct sockaddr *) &unaddr, addrlen) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (listen(fd, 8) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* starts the exporter thread in the parent when a metrics address is configured */
+void metrics_start() {
+	sigset_t sigset, oldset;
+
+	if (metrics_addr == NULL || shm == NULL)
+		return;
+
+	if ((metrics_socket = metrics_listen()) < 0) {
+		PRINT_ERROR("Could not listen for metrics on '%s' %s\n", metrics_addr, strerror(errno));
+		return;
+	}
+
+	PRINT_VERBOSE("serving metrics on '%s'\n", metrics_addr);
+
+	/* the signals are handled by the accepting main thread */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	if (pthread_create(&metrics_thread, NULL, &metrics_loop, NULL)) {
+		PRINT_ERROR("could not create metrics thread.\n");
+		close(metrics_socket);
+		metrics_socket = -1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	/* the bus counters are scraped from the snapshots */
+	if (metrics_socket >= 0)
+		statistics_collector_start();
+}
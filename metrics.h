@@ -0,0 +1,42 @@
+#include <pthread.h>
+
+#define METRICS_MAX_CLIENTS 256
+#define METRICS_REQUEST_LEN 4096
+#define METRICS_TIMEOUT 2 /* seconds to receive the request of a scraper */
+
+/* lowest and highest bucket of the exported latency histograms: 2^n ns */
+#define METRICS_LAT_MIN_EXP 10 /* ~1us */
+#define METRICS_LAT_MAX_EXP 30 /* ~1s */
+
+/* counters of a connection process in the shared mapping */
+struct client_slot {
+	pid_t pid; /* 0: free, -1: claimed but not yet forked */
+	unsigned long long conn; /* serial number - a pool worker serves many connections */
+	int state;
+	int stat_ival; /* ms, '< statistics ival >' in control mode */
+	char bus_name[MAX_BUSNAME];
+	struct conn_stats stats;
+};
+
+struct metrics_shm {
+	pthread_mutex_t lock; /* slots and finished - acceptors and workers claim concurrently */
+	unsigned long long connections; /* accepted connections */
+	unsigned long long fork_errors;
+	unsigned long long untracked; /* connections that did not get a slot */
+	struct conn_stats finished; /* sum of the reaped connection processes */
+	struct client_slot clients[METRICS_MAX_CLIENTS];
+};
+
+extern char *metrics_addr;
+
+void metrics_init();
+void metrics_start();
+struct client_slot *metrics_claim();
+void metrics_forked(struct client_slot *slot, pid_t pid);
+void metrics_child(struct client_slot *slot);
+void metrics_reaped(pid_t pid);
+void metrics_release();
+void metrics_client_update();
+void metrics_client_ival(int ival);
+int metrics_min_ival();
+int metrics_clients(const char *bus);
@@ -0,0 +1,178 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "metrics.h"
+#include "listen.h"
+#include "trace.h"
+#include "pool.h"
+
+/*
+ * Pre-forked worker pool
+ *
+ * With pool_workers > 0 the acceptor does not fork for every connection.
+ * It keeps pool_workers idle workers that share its listening sockets and
+ * accept the connections themselves. After the connection has ended (and a
+ * named BCM session has been handed over or expired) the worker resets the
+ * connection state and accepts the next one. The interface indexes of the
+ * busses are resolved once per worker.
+ *
+ * The acceptor forks new workers when fewer than pool_workers are idle, a
+ * worker exits when more are idle after its connection and after
+ * POOL_MAX_SERVED connections to bound the effect of leaks.
+ */
+
+int pool_workers;
+
+static struct pool_worker *pool; /* shared with the workers */
+static int pool_pipe[2] = { -1, -1 }; /* workers wake the acceptor when they get busy */
+
+static int pool_idle() {
+	int i, n = 0;
+
+	for (i = 0; i < POOL_MAX; i++) {
+		if (pool[i].pid != 0 && !pool[i].busy)
+			n++;
+	}
+
+	return n;
+}
+
+static void worker_loop(struct pool_worker *self) {
+	struct client_slot *slot;
+	int i, served;
+
+	close(pool_pipe[0]);
+	reap_close();
+	listen_unpin();
+
+	/* a worker is of no use without its acceptor */
+	prctl(PR_SET_PDEATHSIG, SIGINT);
+
+	for (i = 0; i < interface_count; i++)
+		bus_ifindex(interface_names[i]);
+
+	for (served = 0; served < POOL_MAX_SERVED; served++) {
+		self->busy = 0;
+
+		/* the burst is over */
+		if (served && pool_idle() > pool_workers)
+			break;
+
+		while ((client_socket = listen_accept(-1)) < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				PRINT_ERROR("Error in accept() %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+
+		self->busy = 1;
+		if (write(pool_pipe[1], "", 1) < 0 && errno != EAGAIN)
+			PRINT_ERROR("Could not wake the acceptor %s\n", strerror(errno));
+
+		TRACE1(accept, client_socket);
+		slot = metrics_claim();
+		metrics_forked(slot, getpid());
+		metrics_child(slot);
+
+		PRINT_VERBOSE("client connected\n");
+		handle_client();
+
+		metrics_release();
+		client_reset();
+	}
+
+	exit(0);
+}
+
+/* forks workers until pool_workers are idle */
+static void pool_fill() {
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < POOL_MAX && pool_idle() < pool_workers; i++) {
+		if (pool[i].pid != 0)
+			continue;
+
+		/* reaped by pool_run() after the pid is known, see fork_client() */
+		pool[i].pid = -1;
+		pool[i].busy = 0;
+		pid = fork();
+
+		if (pid == 0)
+			worker_loop(&pool[i]);
+
+		pool[i].pid = (pid < 0) ? 0 : pid;
+
+		if (pid < 0) {
+			PRINT_ERROR("Could not fork worker %s\n", strerror(errno));
+			return;
+		}
+	}
+}
+
+/* called by reap_children() for every reaped process */
+void pool_reaped(pid_t pid) {
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	for (i = 0; i < POOL_MAX; i++) {
+		if (pool[i].pid == pid) {
+			pool[i].pid = 0;
+			return;
+		}
+	}
+}
+
+/* keeps the pool of the acceptor filled - does not return */
+int pool_run() {
+	struct pollfd pfd[2];
+	char buf[64];
+
+	pool = mmap(NULL, POOL_MAX * sizeof(*pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED || pipe(pool_pipe) < 0) {
+		PRINT_ERROR("Could not create the worker pool %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(pool, 0, POOL_MAX * sizeof(*pool));
+
+	fcntl(pool_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(pool_pipe[1], F_SETFL, O_NONBLOCK);
+
+	PRINT_VERBOSE("keeping %d idle workers\n", pool_workers);
+
+	pfd[0].fd = pool_pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = reap_pipe[0];
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		pool_fill();
+
+		/* a busy worker or a dying one changes the number of idle workers */
+		if (poll(pfd, 2, POOL_CHECK_MS) > 0) {
+			while (read(pool_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		}
+
+		reap_children();
+	}
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+#define POOL_MAX 256 /* workers of an acceptor */
+#define POOL_MAX_SERVED 1000 /* connections before a worker is replaced */
+#define POOL_CHECK_MS 1000
+
+/* a pre-forked worker in the shared mapping of its acceptor */
+struct pool_worker {
+	pid_t pid; /* 0: free, -1: being forked */
+	int busy;
+};
+
+extern int pool_workers;
+
+int pool_run();
+void pool_reaped(pid_t pid);
@@ -0,0 +1,308 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <syslog.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "socketcand.h"
+#include "profiler.h"
+
+/*
+ * Per CAN ID traffic profiler
+ *
+ * While the profiler runs, a RAW socket on the bus is read in the control
+ * mode event loop and every frame updates the statistics of its ID: count,
+ * period (mean, min, max and standard deviation as jitter), changes of the
+ * data length and the time it was last seen. Standard IDs index a table of
+ * 2048 entries directly, extended IDs are kept in an open addressing hash
+ * table. The client fetches the whole profile with '< profile report >'.
+ */
+
+#define REPORT_CHUNK 4096
+
+static int profile_socket = -1;
+static struct profile_entry *sff;
+static struct profile_entry *eff;
+static unsigned int eff_size, eff_used;
+static unsigned int eff_dropped; /* extended IDs beyond PROFILE_EFF_MAX */
+
+static unsigned int eff_hash(canid_t can_id) {
+	/* Fibonacci hashing spreads the usually clustered IDs */
+	return (can_id * 2654435761U);
+}
+
+static struct profile_entry *eff_slot(struct profile_entry *table, unsigned int size, canid_t can_id) {
+	unsigned int i = eff_hash(can_id) & (size - 1);
+
+	while (table[i].can_id && table[i].can_id != can_id)
+		i = (i + 1) & (size - 1);
+
+	return &table[i];
+}
+
+static int eff_grow() {
+	struct profile_entry *table;
+	unsigned int i, size = eff_size ? eff_size * 2 : PROFILE_EFF_INITIAL;
+
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return -1;
+
+	for (i = 0; i < eff_size; i++) {
+		if (eff[i].can_id)
+			*eff_slot(table, size, eff[i].can_id) = eff[i];
+	}
+
+	free(eff);
+	eff = table;
+	eff_size = size;
+	return 0;
+}
+
+static struct profile_entry *eff_lookup(canid_t can_id) {
+	struct profile_entry *entry;
+
+	if (eff_size == 0 && eff_grow() < 0)
+		return NULL;
+
+	entry = eff_slot(eff, eff_size, can_id);
+	if (entry->can_id)
+		return entry;
+
+	if (eff_used >= PROFILE_EFF_MAX) {
+		eff_dropped++;
+		return NULL;
+	}
+
+	if (4 * (eff_used + 1) > 3 * eff_size) {
+		if (eff_grow() < 0)
+			return NULL;
+		entry = eff_slot(eff, eff_size, can_id);
+	}
+
+	entry->can_id = can_id;
+	eff_used++;
+	return entry;
+}
+
+static void profile_update(struct profile_entry *entry, unsigned char len, long long now) {
+	long long period;
+	double delta;
+
+	if (entry->count) {
+		period = now - entry->last;
+
+		/* running mean and variance of the period */
+		delta = period - entry->period_mean;
+		entry->period_mean += delta / entry->count;
+		entry->period_m2 += delta * (period - entry->period_mean);
+
+		if (entry->count == 1 || period < entry->period_min)
+			entry->period_min = period;
+		if (period > entry->period_max)
+			entry->period_max = period;
+
+		if (len != entry->len)
+			entry->len_changes++;
+	}
+
+	entry->count++;
+	entry->len = len;
+	entry->last = now;
+}
+
+int profiler_start(const char *bus) {
+	struct sockaddr_can addr;
+	int on = 1;
+
+	if (profile_socket >= 0)
+		return 0;
+
+	if (sff == NULL && (sff = calloc(PROFILE_SFF_IDS, sizeof(*sff))) == NULL)
+		return -1;
+
+	if ((profile_socket = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW)) < 0) {
+		PRINT_ERROR("Error while creating profiler socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(profile_socket, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+	setsockopt(profile_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = bus_ifindex(bus);
+	if (addr.can_ifindex == 0) {
+		PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
+		profiler_stop();
+		return -1;
+	}
+
+	if (bind(profile_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding profiler socket %s\n", strerror(errno));
+		profiler_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* stops receiving - the collected profile is kept until the next reset */
+void profiler_stop() {
+	if (profile_socket >= 0)
+		close(profile_socket);
+	profile_socket = -1;
+}
+
+int profiler_fd() {
+	return profile_socket;
+}
+
+void profiler_receive() {
+	struct canfd_frame frame;
+	struct profile_entry *entry;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	char ctrl[CMSG_SPACE(sizeof(struct timeval))];
+	int i, ret;
+
+	iov.iov_base = &frame;
+	iov.iov_len = sizeof(frame);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+
+	for (i = 0; i < PROFILE_BATCH; i++) {
+		msg.msg_controllen = sizeof(ctrl);
+
+		ret = recvmsg(profile_socket, &msg, MSG_DONTWAIT);
+		if (ret < (int) CAN_MTU)
+			return;
+
+		if (frame.can_id & CAN_ERR_FLAG)
+			continue;
+
+		gettimeofday(&tv, NULL);
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMP)
+				tv = *(struct timeval *) CMSG_DATA(cmsg);
+		}
+
+		if (frame.can_id & CAN_EFF_FLAG)
+			entry = eff_lookup(frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+		else
+			entry = &sff[frame.can_id & CAN_SFF_MASK];
+
+		if (entry)
+			profile_update(entry, frame.len, tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL);
+	}
+}
+
+void profiler_reset() {
+	if (sff)
+		memset(sff, 0, PROFILE_SFF_IDS * sizeof(*sff));
+
+	free(eff);
+	eff = NULL;
+	eff_size = eff_used = eff_dropped = 0;
+}
+
+/* integer square root - avoids libm for the jitter */
+static unsigned long long isqrt(unsigned long long val) {
+	unsigned long long x = val, y = (x + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + val / x) / 2;
+	}
+
+	return x;
+}
+
+/* standard deviation of the period in us */
+static long long jitter_us(struct profile_entry *entry) {
+	if (entry->count <= 2)
+		return 0;
+
+	return isqrt(entry->period_m2 / (entry->count - 2) / 1000000.0);
+}
+
+static int report_entry(char *buf, canid_t can_id, struct profile_entry *entry) {
+	int len;
+
+	if (can_id & CAN_EFF_FLAG)
+		len = sprintf(buf, " %08X", can_id & CAN_EFF_MASK);
+	else
+		len = sprintf(buf, " %03X", can_id);
+
+	/* periods and jitter in us */
+	len += sprintf(buf + len, " %u %lld %lld %lld %lld %u %lld.%06lld", entry->count,
+		       (long long) (entry->period_mean / 1000),
+		       entry->period_min / 1000, entry->period_max / 1000,
+		       jitter_us(entry),
+		       entry->len_changes,
+		       entry->last / 1000000000LL, (entry->last / 1000) % 1000000);
+
+	return len;
+}
+
+/*
+ * '< profile n dropped ID count mean min max jitter len_changes last ... >'
+ * n is the number of IDs, dropped the number of frames with extended IDs
+ * beyond PROFILE_EFF_MAX that were not profiled.
+ */
+void profiler_report() {
+	char buf[REPORT_CHUNK + 128];
+	unsigned int i, n = 0;
+	int len = 0;
+
+	if (sff) {
+		for (i = 0; i < PROFILE_SFF_IDS; i++) {
+			if (sff[i].count)
+				n++;
+		}
+	}
+	n += eff_used;
+
+	len = sprintf(buf, "< profile %u %u", n, eff_dropped);
+
+	for (i = 0; sff && i < PROFILE_SFF_IDS; i++) {
+		if (!sff[i].count)
+			continue;
+
+		len += report_entry(buf + len, i, &sff[i]);
+		if (len > REPORT_CHUNK) {
+			client_send(buf, len, MSG_MORE);
+			len = 0;
+		}
+	}
+
+	for (i = 0; i < eff_size; i++) {
+		if (!eff[i].can_id)
+			continue;
+
+		len += report_entry(buf + len, eff[i].can_id, &eff[i]);
+		if (len > REPORT_CHUNK) {
+			client_send(buf, len, MSG_MORE);
+			len = 0;
+		}
+	}
+
+	len += sprintf(buf + len, " >");
+	client_send(buf, len, 0);
+}
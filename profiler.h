@@ -0,0 +1,29 @@
+#include <linux/can.h>
+
+/*
+ * Per CAN ID traffic profiler - see '< profile ... >' in control mode
+ */
+
+#define PROFILE_SFF_IDS (CAN_SFF_MASK + 1) /* direct-mapped */
+#define PROFILE_EFF_INITIAL 256 /* hash table size, doubled when 3/4 full */
+#define PROFILE_EFF_MAX 65536 /* extended IDs that are tracked */
+#define PROFILE_BATCH 64 /* frames handled per call before the client gets its turn */
+
+struct profile_entry {
+	canid_t can_id; /* including CAN_EFF_FLAG, 0: unused EFF slot */
+	unsigned int count;
+	unsigned int len_changes;
+	unsigned char len; /* data length of the last frame */
+	long long last; /* ns, time of the last frame */
+	long long period_min; /* ns */
+	long long period_max;
+	double period_mean; /* ns, running mean and squared deviation (Welford) */
+	double period_m2;
+};
+
+int profiler_start(const char *bus);
+void profiler_stop();
+int profiler_fd();
+void profiler_receive();
+void profiler_report();
+void profiler_reset();
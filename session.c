@@ -0,0 +1,485 @@
+#define _GNU_SOURCE /* struct ucred */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "session.h"
+
+/*
+ * Persistent BCM sessions
+ *
+ * A client may name its BCM session with '< session NAME >'. When the
+ * connection of a named session drops, the connection process keeps the BCM
+ * socket (and therefore all cyclic TX jobs and RX filters in the kernel) open
+ * for session_timeout seconds and waits on the abstract AF_UNIX socket
+ * '\0socketcand-session-PORT-NAME'. A new connection sending '< resume NAME >'
+ * connects to this socket and gets the BCM socket handed over via
+ * SCM_RIGHTS together with the registry of the jobs that have been set up.
+ *
+ * Abstract names have no permissions: both ends check with SO_PEERCRED that
+ * the peer is a process of this daemon running as the same user, and the
+ * received descriptor must be a CAN BCM socket.
+ */
+
+#define SESSION_PREFIX "socketcand-session-"
+
+struct session_job {
+	int kind;
+	canid_t can_id;
+	struct timeval ival;
+	char *cmd; /* the command that set up the job, e.g. '< add 1 0 123 1 11 >' */
+};
+
+/* handover header - the BCM socket is passed as ancillary data along with it */
+struct session_head {
+	char bus_name[MAX_BUSNAME];
+	int njobs;
+};
+
+struct session_job_head {
+	int kind;
+	canid_t can_id;
+	struct timeval ival;
+	int len;
+};
+
+char session_name[SESSION_NAME_LEN];
+int session_timeout = SESSION_TIMEOUT;
+
+static struct session_job *jobs = NULL;
+static int njobs = 0;
+static int jobs_allocated = 0;
+
+static int session_find_job(int kind, canid_t can_id) {
+	int i;
+
+	for(i=0;i<njobs;i++) {
+		if(jobs[i].kind == kind && jobs[i].can_id == can_id)
+			return i;
+	}
+	return -1;
+}
+
+int session_set_name(char *name) {
+	int i, len = strlen(name);
+
+	if(len == 0 || len >= SESSION_NAME_LEN)
+		return -1;
+
+	for(i=0;i<len;i++) {
+		if(!isalnum(name[i]) && name[i] != '-' && name[i] != '_' && name[i] != '.')
+			return -1;
+	}
+
+	strcpy(session_name, name);
+	return 0;
+}
+
+void session_add_job(int kind, canid_t can_id, struct timeval *ival, char *cmd) {
+	int i;
+	char *copy = strdup(cmd);
+
+	if(copy == NULL)
+		return;
+
+	i = session_find_job(kind, can_id);
+	if(i >= 0) {
+		/* a new setup for the same CAN ID replaces the kernel job */
+		free(jobs[i].cmd);
+	} else {
+		if(njobs == jobs_allocated) {
+			struct session_job *tmp;
+
+			tmp = realloc(jobs, sizeof(*jobs) * (jobs_allocated + 64));
+			if(tmp == NULL) {
+				free(copy);
+				return;
+			}
+			jobs = tmp;
+			jobs_allocated += 64;
+		}
+		i = njobs++;
+	}
+
+	jobs[i].kind = kind;
+	jobs[i].can_id = can_id;
+	jobs[i].ival = *ival;
+	jobs[i].cmd = copy;
+}
+
+void session_update_job(int kind, canid_t can_id, char *cmd) {
+	int i, len;
+	char *newcmd, *data;
+
+	i = session_find_job(kind, can_id);
+	data = element_start(cmd, 2);
+	if(i < 0 || data == NULL)
+		return;
+
+	/*
+	 * '< update can_id ... >' keeps the timers of the job. Rebuild the
+	 * setup command from the stored one to reflect the new content, e.g.
+	 * '< add 1 0 123 1 11 >' + '< update 123 2 11 22 >' => '< add 1 0 123 2 11 22 >'
+	 */
+	len = element_length(jobs[i].cmd, 1);
+	newcmd = malloc(len + strlen(data) + 48);
+	if(newcmd == NULL)
+		return;
+
+	sprintf(newcmd, "< %.*s %lu %lu %s", len, element_start(jobs[i].cmd, 1),
+		jobs[i].ival.tv_sec, jobs[i].ival.tv_usec, data);
+
+	free(jobs[i].cmd);
+	jobs[i].cmd = newcmd;
+}
+
+void session_delete_job(int kind, canid_t can_id) {
+	int i = session_find_job(kind, can_id);
+
+	if(i < 0)
+		return;
+
+	free(jobs[i].cmd);
+	jobs[i] = jobs[--njobs];
+}
+
+void session_clear_jobs() {
+	int i;
+
+	for(i=0;i<njobs;i++)
+		free(jobs[i].cmd);
+
+	njobs = 0;
+}
+
+/* report the registered jobs to the client as '< job add 1 0 123 1 11 >' */
+void session_send_jobs() {
+	int i;
+	char *buf;
+
+	for(i=0;i<njobs;i++) {
+		buf = malloc(strlen(jobs[i].cmd) + 5);
+		if(buf == NULL)
+			return;
+
+		sprintf(buf, "< job %s", jobs[i].cmd + 2);
+		client_send(buf, strlen(buf), 0);
+		free(buf);
+	}
+}
+
+static socklen_t session_address(struct sockaddr_un *addr, char *name) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/* abstract socket address with leading '\0' */
+	snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, SESSION_PREFIX "%d-%s", port, name);
+	return sizeof(addr->sun_family) + 1 + strlen(&addr->sun_path[1]);
+}
+
+/* 1 when pid is a descendant of the daemon */
+static int session_in_daemon(pid_t pid) {
+	char path[32], buf[512], *ptr;
+	FILE *f;
+	int depth;
+
+	for(depth=0;depth<16 && pid > 1;depth++) {
+		if(pid == daemon_pid)
+			return 1;
+
+		snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+		if((f = fopen(path, "r")) == NULL)
+			return 0;
+		ptr = fgets(buf, sizeof(buf), f);
+		fclose(f);
+
+		/* 'pid (comm) state ppid ...' - comm may contain anything */
+		if(ptr == NULL || (ptr = strrchr(buf, ')')) == NULL ||
+		   sscanf(ptr + 1, " %*c %d", &pid) != 1)
+			return 0;
+	}
+
+	return pid == daemon_pid;
+}
+
+static int session_peer_ok(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+
+	if(cred.uid != geteuid() || !session_in_daemon(cred.pid)) {
+		PRINT_ERROR("Rejected session peer pid %d uid %d\n", (int) cred.pid, (int) cred.uid);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int session_bcm_socket_ok(int fd) {
+	int domain, protocol;
+	socklen_t len = sizeof(int);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+		return 0;
+	len = sizeof(int);
+	if(getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) < 0)
+		return 0;
+
+	return domain == AF_CAN && protocol == CAN_BCM;
+}
+
+static int write_all(int fd, void *data, int len) {
+	int ret;
+	char *ptr = data;
+
+	while(len > 0) {
+		ret = write(fd, ptr, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *data, int len) {
+	int ret;
+	char *ptr = data;
+
+	while(len > 0) {
+		ret = read(fd, ptr, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int session_handover(int fd, int bcm_socket) {
+	struct session_head head;
+	struct session_job_head job_head;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int i;
+
+	memset(&head, 0, sizeof(head));
+	strcpy(head.bus_name, bus_name);
+	head.njobs = njobs;
+
+	iov.iov_base = &head;
+	iov.iov_len = sizeof(head);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &bcm_socket, sizeof(int));
+
+	if(sendmsg(fd, &msg, 0) != sizeof(head))
+		return -1;
+
+	for(i=0;i<njobs;i++) {
+		job_head.kind = jobs[i].kind;
+		job_head.can_id = jobs[i].can_id;
+		job_head.ival = jobs[i].ival;
+		job_head.len = strlen(jobs[i].cmd);
+
+		if(write_all(fd, &job_head, sizeof(job_head)) < 0 ||
+		   write_all(fd, jobs[i].cmd, job_head.len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called when the client of a named BCM session has gone. Keeps the BCM socket
+ * open for session_timeout seconds and hands it over to the first connection
+ * that resumes the session.
+ */
+void session_linger(int bcm_socket) {
+	int ls, fd, ret, resumed = 0;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	fd_set fds;
+	struct timeval timeout;
+	time_t deadline;
+	char buf[256];
+
+	close(client_socket);
+	client_socket = -1;
+
+	if((ls = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+		PRINT_ERROR("Error while opening session socket %s\n", strerror(errno));
+		return;
+	}
+
+	addrlen = session_address(&addr, session_name);
+	if(bind(ls, (struct sockaddr *)&addr, addrlen) < 0 || listen(ls, 1) < 0) {
+		PRINT_ERROR("Could not keep session '%s' %s\n", session_name, strerror(errno));
+		close(ls);
+		return;
+	}
+
+	PRINT_INFO("keeping session '%s' for %d seconds\n", session_name, session_timeout);
+
+	deadline = time(NULL) + session_timeout;
+	while((timeout.tv_sec = deadline - time(NULL)) > 0) {
+		timeout.tv_usec = 0;
+
+		FD_ZERO(&fds);
+		FD_SET(ls, &fds);
+		FD_SET(bcm_socket, &fds);
+
+		ret = select((ls > bcm_socket)?ls+1:bcm_socket+1, &fds, NULL, NULL, &timeout);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* nobody is interested in frames received while the client is away */
+		if(FD_ISSET(bcm_socket, &fds))
+			recv(bcm_socket, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if(FD_ISSET(ls, &fds)) {
+			fd = accept(ls, NULL, NULL);
+			if(fd < 0)
+				continue;
+
+			if(!session_peer_ok(fd)) {
+				close(fd);
+				continue;
+			}
+
+			ret = session_handover(fd, bcm_socket);
+			close(fd);
+			if(ret == 0) {
+				PRINT_INFO("session '%s' resumed\n", session_name);
+				resumed = 1;
+				break;
+			}
+		}
+	}
+
+	if(!resumed)
+		PRINT_INFO("session '%s' expired\n", session_name);
+
+	close(ls);
+}
+
+/*
+ * Take over the BCM socket and the job registry of a lingering session.
+ * On success bus_name and session_name are set and the BCM socket is returned.
+ */
+int session_resume(char *name) {
+	int fd, bcm_socket = -1;
+	int i;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct session_head head;
+	struct session_job_head job_head;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	char *cmd;
+
+	if(strlen(name) == 0 || strlen(name) >= SESSION_NAME_LEN)
+		return -1;
+
+	if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	addrlen = session_address(&addr, name);
+	if(connect(fd, (struct sockaddr *)&addr, addrlen) < 0 || !session_peer_ok(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	iov.iov_base = &head;
+	iov.iov_len = sizeof(head);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if(recvmsg(fd, &msg, MSG_WAITALL) != sizeof(head))
+		goto error;
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&bcm_socket, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if(bcm_socket < 0)
+		goto error;
+
+	if(!session_bcm_socket_ok(bcm_socket)) {
+		PRINT_ERROR("Session '%s' did not pass a BCM socket\n", name);
+		goto error;
+	}
+
+	head.bus_name[MAX_BUSNAME-1] = '\0';
+	session_clear_jobs();
+
+	for(i=0;i<head.njobs;i++) {
+		if(read_all(fd, &job_head, sizeof(job_head)) < 0 ||
+		   job_head.len <= 0 || job_head.len >= MAXLEN)
+			goto error;
+
+		cmd = malloc(job_head.len + 1);
+		if(cmd == NULL)
+			goto error;
+
+		if(read_all(fd, cmd, job_head.len) < 0) {
+			free(cmd);
+			goto error;
+		}
+		cmd[job_head.len] = '\0';
+
+		session_add_job(job_head.kind, job_head.can_id, &job_head.ival, cmd);
+		free(cmd);
+	}
+
+	close(fd);
+	strcpy(bus_name, head.bus_name);
+	strcpy(session_name, name);
+	return bcm_socket;
+
+error:
+	session_clear_jobs();
+	if(bcm_socket >= 0)
+		close(bcm_socket);
+	close(fd);
+	return -1;
+}
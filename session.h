@@ -0,0 +1,22 @@
+#include <sys/time.h>
+#include <linux/can.h>
+
+#define SESSION_NAME_LEN 32+1
+#define SESSION_TIMEOUT 30 /* grace period in seconds after client disconnect */
+
+/* kind of a registered BCM job - TX_SETUP and RX_SETUP jobs live in different lists */
+#define SESSION_JOB_TX 0
+#define SESSION_JOB_RX 1
+#define SESSION_JOB_FD 2 /* CAN FD jobs are separate from classic CAN jobs */
+
+extern char session_name[];
+extern int session_timeout;
+
+int session_set_name(char *name);
+void session_add_job(int kind, canid_t can_id, struct timeval *ival, char *cmd);
+void session_update_job(int kind, canid_t can_id, char *cmd);
+void session_delete_job(int kind, canid_t can_id);
+void session_clear_jobs();
+void session_send_jobs();
+void session_linger(int bcm_socket);
+int session_resume(char *name);
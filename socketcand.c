@@ -51,8 +51,10 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -65,6 +67,7 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <syslog.h>
+#include <linux/sockios.h>
 #ifdef HAVE_LIBCONFIG
 #include <libconfig.h>
 #endif
@@ -72,20 +75,36 @@
 #include "socketcand.h"
 #include "statistics.h"
 #include "beacon.h"
+#include "session.h"
+#include "metrics.h"
+#include "trace.h"
+#include "listen.h"
+#include "pool.h"
+
+/* long options without a short option */
+#define OPT_BEACON_TTL 256
+#define OPT_BEACON_INTERVAL 257
+#define OPT_BACKLOG 258
+#define OPT_ACCEPTORS 259
+#define OPT_WORKERS 260
 
 void print_usage(void);
 void sigint();
 void childdied();
+int fork_client();
+static void lazy_start();
 void determine_adress();
 int receive_command(int socket, char *buf);
+static void consume_buffer(int len);
 
-int sl, client_socket;
-pthread_t beacon_thread, statistics_thread;
+int client_socket;
 char **interface_names;
 int interface_count=0;
 int port;
 int verbose_flag=0;
 int daemon_flag=0;
+pid_t daemon_pid;
+int reap_pipe[2] = { -1, -1 }; /* SIGCHLD wakes the accept loop */
 int disable_beacon=0;
 int state = STATE_NO_BUS;
 int previous_state = -1;
@@ -95,11 +114,11 @@ int cmd_index=0;
 char* description;
 char* afuxname;
 int more_elements = 0;
+static struct conn_stats local_conn_stats;
+static int *ifindex_cache;
+static int lazy_pending; /* lazy_start() after the first connection */
+struct conn_stats *conn_stats = &local_conn_stats;
 struct sockaddr_in saddr, broadcast_addr;
-struct sockaddr_un unaddr;
-socklen_t unaddrlen;
-struct sockaddr_un remote_unaddr;
-socklen_t remote_unaddrlen;
 char* interface_string;
 struct ifreq ifr, ifr_brd;
 
@@ -114,8 +133,11 @@ int state_changed(char *buf, int current_state)
 	else if(!strcmp("< controlmode >", buf))
 		state = STATE_CONTROL;
 
-	if (current_state != state)
+	if (current_state != state) {
+		TRACE2(state_change, current_state, state);
 		PRINT_INFO("state changed to %d\n", state);
+		metrics_client_update();
+	}
 
 	return (current_state != state);
 }
@@ -188,20 +210,191 @@ int asc2nibble(char c)
 	return 16; /* error */
 }
 
+/*
+ * Table driven PDU data encoding. The tables translate a whole byte (hex) or
+ * a 6 bit group (base64) with a single lookup instead of formatting and
+ * parsing the data character by character.
+ */
+static const char hex_digits[] = "0123456789ABCDEF";
+static const char base64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char hex_table[256][2];
+static unsigned char hex_value[256];
+static unsigned char base64_value[256];
+
+static void codec_init() {
+	static int initialized = 0;
+	int i;
+
+	if(initialized)
+		return;
+
+	for(i=0;i<256;i++) {
+		hex_table[i][0] = hex_digits[i >> 4];
+		hex_table[i][1] = hex_digits[i & 0x0F];
+		hex_value[i] = asc2nibble(i);
+		base64_value[i] = 0xFF;
+	}
+
+	for(i=0;i<64;i++)
+		base64_value[(unsigned char) base64_digits[i]] = i;
+
+	initialized = 1;
+}
+
+/* returns the number of characters written to dst (without the trailing '\0') */
+int hex_encode(char *dst, const unsigned char *src, int len) {
+	int i;
+
+	codec_init();
+
+	for(i=0;i<len;i++) {
+		dst[2*i] = hex_table[src[i]][0];
+		dst[2*i+1] = hex_table[src[i]][1];
+	}
+	dst[2*len] = '\0';
+
+	return 2*len;
+}
+
+/* returns the number of bytes written to dst or -1 for invalid data */
+int hex_decode(unsigned char *dst, const char *src, int len) {
+	int i;
+	unsigned char hi, lo;
+
+	codec_init();
+
+	if(len & 1)
+		return -1;
+
+	for(i=0;i<len/2;i++) {
+		hi = hex_value[(unsigned char) src[2*i]];
+		lo = hex_value[(unsigned char) src[2*i+1]];
+		if((hi | lo) > 0x0F)
+			return -1;
+		dst[i] = (hi << 4) | lo;
+	}
+
+	return len/2;
+}
+
+/* returns the number of characters written to dst (without the trailing '\0') */
+int base64_encode(char *dst, const unsigned char *src, int len) {
+	int i, n = 0;
+	unsigned int v;
+
+	for(i=0;i+2<len;i+=3) {
+		v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+		dst[n++] = base64_digits[v >> 18];
+		dst[n++] = base64_digits[(v >> 12) & 0x3F];
+		dst[n++] = base64_digits[(v >> 6) & 0x3F];
+		dst[n++] = base64_digits[v & 0x3F];
+	}
+
+	if(i < len) {
+		v = src[i] << 16;
+		if(i+1 < len)
+			v |= src[i+1] << 8;
+
+		dst[n++] = base64_digits[v >> 18];
+		dst[n++] = base64_digits[(v >> 12) & 0x3F];
+		dst[n++] = (i+1 < len) ? base64_digits[(v >> 6) & 0x3F] : '=';
+		dst[n++] = '=';
+	}
+	dst[n] = '\0';
+
+	return n;
+}
+
+/* returns the number of bytes written to dst or -1 for invalid data */
+int base64_decode(unsigned char *dst, const char *src, int len) {
+	int i, n = 0, pad = 0;
+	unsigned char a, b, c, d;
+
+	codec_init();
+
+	if(len & 3)
+		return -1;
+
+	if(len > 0 && src[len-1] == '=')
+		pad++;
+	if(len > 1 && src[len-2] == '=')
+		pad++;
+
+	for(i=0;i<len;i+=4) {
+		a = base64_value[(unsigned char) src[i]];
+		b = base64_value[(unsigned char) src[i+1]];
+		c = base64_value[(unsigned char) src[i+2]];
+		d = base64_value[(unsigned char) src[i+3]];
+
+		/* the padding is only allowed at the very end */
+		if(i+4 == len) {
+			if(pad >= 1)
+				d = 0;
+			if(pad == 2)
+				c = 0;
+		}
+
+		if((a | b | c | d) > 0x3F)
+			return -1;
+
+		dst[n++] = (a << 2) | (b >> 4);
+		dst[n++] = (b << 4) | (c >> 2);
+		dst[n++] = (c << 6) | d;
+	}
+
+	return n - pad;
+}
+
+#ifdef HAVE_LIBCONFIG
+/*
+ * isotp_timing = {
+ *	can0 = { frame_txtime = 0; tx_stmin = 500000; rx_stmin = 0; flags = 0x80; };
+ * };
+ */
+static void read_isotp_profiles(config_t *config)
+{
+	int i, val;
+	config_setting_t *profiles, *profile;
+	struct isotp_timing timing;
+
+	profiles = config_lookup(config, "isotp_timing");
+	if(profiles == NULL)
+		return;
+
+	for(i=0;i<config_setting_length(profiles);i++) {
+		profile = config_setting_get_elem(profiles, i);
+		memset(&timing, 0, sizeof(timing));
+
+		if(config_setting_lookup_int(profile, "frame_txtime", &val))
+			timing.frame_txtime = val;
+		if(config_setting_lookup_int(profile, "tx_stmin", &val))
+			timing.tx_stmin = val;
+		if(config_setting_lookup_int(profile, "rx_stmin", &val))
+			timing.rx_stmin = val;
+		if(config_setting_lookup_int(profile, "flags", &val))
+			timing.flags = val;
+
+		isotp_set_profile(config_setting_name(profile), &timing);
+	}
+}
+#endif
+
 int main(int argc, char **argv)
 {
-	int i, found;
-	struct sockaddr_in clientaddr;
-	socklen_t sin_size = sizeof(clientaddr);
+	int i;
 	struct sigaction signalaction, sigint_action;
 	sigset_t sigset;
-	char buf[MAXLEN];
 	int c;
 	char* busses_string;
 #ifdef HAVE_LIBCONFIG
 	config_t config;
 #endif
 
+	log_init();
+	daemon_pid = getpid();
+
 	/* set default config settings */
 	port = PORT;
 	description = malloc(sizeof(BEACON_DESCRIPTION));
@@ -220,8 +413,19 @@ int main(int argc, char **argv)
 		config_lookup_int(&config, "port", (int*) &port);
 		config_lookup_string(&config, "description", (const char**) &description);
 		config_lookup_string(&config, "afuxname", (const char**) &afuxname);
+		config_lookup_string(&config, "address", (const char**) &listen_addrs);
+		config_lookup_int(&config, "backlog", &listen_backlog);
+		config_lookup_int(&config, "acceptors", &acceptors);
+		config_lookup_int(&config, "workers", &pool_workers);
+		config_lookup_string(&config, "metrics", (const char**) &metrics_addr);
+		config_lookup_string(&config, "beacon", (const char**) &beacon_mode);
+		config_lookup_int(&config, "beacon_ttl", &beacon_ttl);
+		config_lookup_int(&config, "beacon_interval", &beacon_interval);
 		config_lookup_string(&config, "busses", (const char**) &busses_string);
 		config_lookup_string(&config, "listen", (const char**) &interface_string);
+		config_lookup_int(&config, "session_timeout", &session_timeout);
+		config_lookup_string(&config, "flash_dir", (const char**) &flash_dir);
+		read_isotp_profiles(&config);
 	}
 #endif
 
@@ -235,14 +439,24 @@ int main(int argc, char **argv)
 			{"port", required_argument, 0, 'p'},
 			{"afuxname", required_argument, 0, 'u'},
 			{"listen", required_argument, 0, 'l'},
+			{"address", required_argument, 0, 'a'},
+			{"backlog", required_argument, 0, OPT_BACKLOG},
+			{"acceptors", required_argument, 0, OPT_ACCEPTORS},
+			{"workers", required_argument, 0, OPT_WORKERS},
 			{"daemon", no_argument, 0, 'd'},
 			{"version", no_argument, 0, 'z'},
 			{"no-beacon", no_argument, 0, 'n'},
+			{"session-timeout", required_argument, 0, 't'},
+			{"flash-dir", required_argument, 0, 'f'},
+			{"metrics", required_argument, 0, 'm'},
+			{"beacon", required_argument, 0, 'b'},
+			{"beacon-ttl", required_argument, 0, OPT_BEACON_TTL},
+			{"beacon-interval", required_argument, 0, OPT_BEACON_INTERVAL},
 			{"help", no_argument, 0, 'h'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long (argc, argv, "vi:p:u:l:dznh", long_options, &option_index);
+		c = getopt_long (argc, argv, "vi:p:u:l:a:t:f:m:b:dznh", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -278,6 +492,46 @@ int main(int argc, char **argv)
 			strcpy(interface_string, optarg);
 			break;
 
+		case 'a':
+			listen_addrs = strdup(optarg);
+			break;
+
+		case OPT_BACKLOG:
+			listen_backlog = atoi(optarg);
+			break;
+
+		case OPT_ACCEPTORS:
+			acceptors = atoi(optarg);
+			break;
+
+		case OPT_WORKERS:
+			pool_workers = atoi(optarg);
+			break;
+
+		case 't':
+			session_timeout = atoi(optarg);
+			break;
+
+		case 'f':
+			flash_dir = strdup(optarg);
+			break;
+
+		case 'm':
+			metrics_addr = strdup(optarg);
+			break;
+
+		case 'b':
+			beacon_mode = strdup(optarg);
+			break;
+
+		case OPT_BEACON_TTL:
+			beacon_ttl = atoi(optarg);
+			break;
+
+		case OPT_BEACON_INTERVAL:
+			beacon_interval = atoi(optarg);
+			break;
+
 		case 'd':
 			daemon_flag=1;
 			break;
@@ -304,6 +558,10 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if(beacon_interval < 1 || beacon_interval > BEACON_INTERVAL_MAX) {
+		PRINT_ERROR("The beacon interval must be 1 to %d seconds\n", BEACON_INTERVAL_MAX);
+		return -1;
+	}
 
 
 	/* parse busses */
@@ -340,149 +598,88 @@ int main(int argc, char **argv)
 	sigint_action.sa_flags = 0;
 	sigaction(SIGINT, &sigint_action, NULL);
 
-	determine_adress();
-
-	if(!disable_beacon) {
-		PRINT_VERBOSE("creating broadcast thread...\n");
-		i = pthread_create(&beacon_thread, NULL, &beacon_loop, NULL);
-		if(i)
-			PRINT_ERROR("could not create broadcast thread.\n");
-	} else {
-		PRINT_VERBOSE("Discovery beacon disabled\n");
-	}
-
-	if (afuxname) {
-
-		/* create PF_UNIX socket */
-		if((sl = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
-			perror("unixsocket");
-			exit(1);
-		}
+	/*
+	 * With socket activation the service manager has bound the sockets and
+	 * started the daemon for a waiting client: the address of the listen
+	 * interface, the beacon and the statistics collector are set up after
+	 * that connection has been forked.
+	 */
+	if(listen_inherit() == 0) {
+		determine_adress();
 
-		unaddr.sun_family = AF_UNIX;
-		if (strlen(afuxname) > sizeof(unaddr.sun_path)-3) {
-			printf("afuxname is too long.\n");
+		if(listen_open() < 0)
 			exit(1);
-		}
-
-		/* when the given afuxname starts with a '/' we assume the path name scheme, e.g.
-		 * /var/run/socketcand or /tmp/socketcand-afunix-socket
-		 * Without the leading '/' we use the string as abstract socket address.
-		 */
-
-		if (afuxname[0] == '/') {
-			strcpy(&unaddr.sun_path[0], afuxname);
-			/* due to the trailing \0 in path name definition we can write the entire struct */
-			unaddrlen = sizeof(unaddr);
-		} else {
-			strcpy(&unaddr.sun_path[1], afuxname);
-			unaddr.sun_path[0] = 0;
-			/* abtract name length definition without trailing \0 but with leading \0 */
-			unaddrlen = strlen(afuxname) + sizeof(unaddr.sun_family) + 1;
-		}
-		PRINT_VERBOSE("binding unix socket to '%s' with unaddrlen %d\n", afuxname, unaddrlen);
-		if(bind(sl,(struct sockaddr*)&unaddr, unaddrlen) < 0) {
-			perror("unixbind");
-			exit(-1);
-		}
+	} else if(metrics_addr) {
+		determine_adress();
+	}
 
-		if (listen(sl,3) != 0) {
-			perror("unixlisten");
-			exit(1);
-		}
+	metrics_init();
+	statistics_collector_init();
+	metrics_start();
 
-		while (1) {
-			remote_unaddrlen = sizeof(struct sockaddr_un);
-			client_socket = accept(sl,(struct sockaddr *)&remote_unaddr, &remote_unaddrlen);
-			if (client_socket > 0 ){
-				if (fork())
-					close(client_socket);
-				else
-					break;
-			}
-			else {
-				if (errno != EINTR) {
-					/*
-					 * If the cause for the error was NOT the
-					 * signal from a dying child => give an error
-					 */
-					perror("accept");
-					exit(1);
-				}
-			}
-		}
+	if(disable_beacon) {
+		PRINT_VERBOSE("Discovery beacon disabled\n");
+	} else if(!listen_activated) {
+		beacon_start();
+	}
 
-		PRINT_VERBOSE("client connected\n");
+	/* one accept loop for all endpoints, in each acceptor */
+	i = listen_acceptors();
+	reap_init();
 
+	if(i > 0) {
+		metrics_child(NULL);
+	} else if(acceptors <= 1 && pool_workers == 0) {
+		lazy_pending = 1;
 	} else {
+		/* the parent may not accept a connection itself */
+		lazy_start();
+	}
 
-		/* create PF_INET socket */
+	listen_notify_ready();
 
-		if((sl = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-			perror("inetsocket");
-			exit(1);
-		}
+	/* the workers accept the connections themselves */
+	if(pool_workers > 0)
+		return pool_run();
 
-#ifdef DEBUG
-		if(verbose_flag)
-			printf("setting SO_REUSEADDR\n");
-		i = 1;
-		if(setsockopt(sl, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) <0) {
-			perror("setting SO_REUSEADDR failed");
+	while (1) {
+		client_socket = listen_accept(reap_pipe[0]);
+		if (client_socket >= 0) {
+			if (fork_client() == 0)
+				break;
 		}
-#endif
-
-		PRINT_VERBOSE("binding socket to %s:%d\n", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
-		if(bind(sl,(struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-			perror("bind");
-			exit(-1);
+		else {
+			if (errno == EINTR)
+				reap_children();
+			else if (errno != EAGAIN) {
+				/*
+				 * If the cause for the error was NOT the
+				 * signal from a dying child => give an error
+				 */
+				perror("accept");
+				exit(1);
+			}
 		}
+	}
 
-		if (listen(sl,3) != 0) {
-			perror("listen");
-			exit(1);
-		}
+	PRINT_VERBOSE("client connected\n");
 
-		while (1) {
-			client_socket = accept(sl,(struct sockaddr *)&clientaddr, &sin_size);
-			if (client_socket > 0 ){
-				int flag;
-				flag = 1;
-				setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
-				if (fork())
-					close(client_socket);
-				else
-					break;
-			}
-			else {
-				if (errno != EINTR) {
-					/*
-					 * If the cause for the error was NOT the
-					 * signal from a dying child => give an error
-					 */
-					perror("accept");
-					exit(1);
-				}
-			}
-		}
+	handle_client();
+	return 0;
+}
 
-		PRINT_VERBOSE("client connected\n");
+/* runs the state machine until the connection of client_socket has ended */
+void handle_client() {
+	int i, found;
+	char buf[MAXLEN];
 
-#ifdef DEBUG
-		PRINT_VERBOSE("setting SO_REUSEADDR\n");
-		i = 1;
-		if(setsockopt(client_socket, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) <0) {
-			perror("setting SO_REUSEADDR failed");
-		}
-#endif
-	}
 	/* main loop with state machine */
 	while(1) {
 		switch(state) {
 		case STATE_NO_BUS:
 			if(previous_state != STATE_NO_BUS) {
 				strcpy(buf, "< hi >");
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 				previous_state = STATE_NO_BUS;
 			}
 			/* client has to start with a command */
@@ -505,19 +702,28 @@ int main(int argc, char **argv)
 
 				if(found) {
 					strcpy(buf, "< ok >");
-					send(client_socket, buf, strlen(buf), 0);
+					client_send(buf, strlen(buf), 0);
 					state = STATE_BCM;
+					metrics_client_update();
 					break;
 				} else {
 					PRINT_INFO("client tried to access unauthorized bus.\n");
 					strcpy(buf, "< error could not open bus >");
-					send(client_socket, buf, strlen(buf), 0);
+					client_send(buf, strlen(buf), 0);
 					state = STATE_SHUTDOWN;
 				}
+			} else if(!strncmp("< resume ", buf, 9)) {
+				if(state_bcm_resume(buf) < 0) {
+					strcpy(buf, "< error could not resume session >");
+					client_send(buf, strlen(buf), 0);
+				} else {
+					metrics_client_update();
+				}
 			} else {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("unknown command '%s'.\n", buf);
 				strcpy(buf, "< error unknown command >");
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 			}
 			break;
 
@@ -537,70 +743,131 @@ int main(int argc, char **argv)
 		case STATE_SHUTDOWN:
 			PRINT_VERBOSE("Closing client connection.\n");
 			close(client_socket);
-			return 0;
+			client_socket = -1;
+			return;
 		}
 	}
-	return 0;
 }
 
-/* reads all available data from the socket into the command buffer.
+/* prepares a worker of the pool for the next connection */
+void client_reset() {
+	state_bcm_close();
+	state_raw_close();
+	state_isotp_close();
+	state_control_close();
+
+	state = STATE_NO_BUS;
+	previous_state = -1;
+	bus_name[0] = '\0';
+	cmd_index = 0;
+	more_elements = 0;
+
+	memset(&local_conn_stats, 0, sizeof(local_conn_stats));
+	conn_stats = &local_conn_stats;
+}
+
+/* interface index of the bus or 0 - the busses of the daemon are resolved once */
+int bus_ifindex(const char *bus) {
+	int i;
+
+	if(ifindex_cache == NULL)
+		ifindex_cache = calloc(interface_count, sizeof(int));
+
+	for(i=0;ifindex_cache && i<interface_count;i++) {
+		if(strcmp(interface_names[i], bus))
+			continue;
+
+		if(!ifindex_cache[i])
+			ifindex_cache[i] = if_nametoindex(bus);
+		return ifindex_cache[i];
+	}
+
+	return if_nametoindex(bus);
+}
+
+/* the interfaces have been removed or recreated with new indexes */
+void bus_ifindex_flush() {
+	if(ifindex_cache)
+		memset(ifindex_cache, 0, interface_count * sizeof(int));
+}
+
+/* reads data from the socket into the command buffer until an element is complete.
  * returns '-1' if no command could be received.
  */
 int receive_command(int socket, char *buffer) {
-	int i, start, stop;
+	int i, ret, start, stop;
 
-	/* if there are no more elements in the buffer read more data from the
-	 * socket.
-	 */
-	if(!more_elements) {
-		cmd_index += read(socket, cmd_buffer+cmd_index, MAXLEN-cmd_index);
+	while(1) {
+		/* if there are no more elements in the buffer read more data from the
+		 * socket.
+		 */
+		if(!more_elements) {
+			if(cmd_index == MAXLEN) {
+				/* the element does not fit into the buffer */
+				cmd_index = 0;
+				return -1;
+			}
+
+			ret = read(socket, cmd_buffer+cmd_index, MAXLEN-cmd_index);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret <= 0)
+				return -1;
+
+			cmd_index += ret;
+			conn_stats->client_rx_bytes += ret;
 #ifdef DEBUG_RECEPTION
-		PRINT_VERBOSE("\tRead from socket\n");
+			PRINT_VERBOSE("\tRead from socket\n");
 #endif
-	}
+		}
 
 #ifdef DEBUG_RECEPTION
-	PRINT_VERBOSE("\tcmd_index now %d\n", cmd_index);
+		PRINT_VERBOSE("\tcmd_index now %d\n", cmd_index);
 #endif
 
-	more_elements = 0;
+		more_elements = 0;
 
-	/* find first '<' in string */
-	start = -1;
-	for(i=0;i<cmd_index;i++) {
-		if(cmd_buffer[i] == '<') {
-			start = i;
-			break;
+		/* find first '<' in string */
+		start = -1;
+		for(i=0;i<cmd_index;i++) {
+			if(cmd_buffer[i] == '<') {
+				start = i;
+				break;
+			}
 		}
-	}
 
-	/*
-	 * if there is no '<' in string it makes no sense to keep data because
-	 * we will never be able to construct a command of it
-	 */
-	if(start == -1) {
-		cmd_index = 0;
+		/*
+		 * if there is no '<' in string it makes no sense to keep data because
+		 * we will never be able to construct a command of it
+		 */
+		if(start == -1) {
+			cmd_index = 0;
 #ifdef DEBUG_RECEPTION
-		PRINT_VERBOSE("\tBad data. No element found\n");
+			PRINT_VERBOSE("\tBad data. No element found\n");
 #endif
-		return -1;
-	}
+			continue;
+		}
 
-	/* check whether the command is completely in the buffer */
-	stop = -1;
-	for(i=1;i<cmd_index;i++) {
-		if(cmd_buffer[i] == '>') {
-			stop = i;
-			break;
+		/* check whether the command is completely in the buffer */
+		stop = -1;
+		for(i=start+1;i<cmd_index;i++) {
+			if(cmd_buffer[i] == '>') {
+				stop = i;
+				break;
+			}
 		}
-	}
 
-	/* if no '>' is in the string we have to wait for more data */
-	if(stop == -1) {
+		if(stop != -1)
+			break;
+
+		/* if no '>' is in the string we have to wait for more data */
 #ifdef DEBUG_RECEPTION
 		PRINT_VERBOSE("\tNo full element in the buffer\n");
 #endif
-		return -1;
+		if(start > 0) {
+			memmove(cmd_buffer, cmd_buffer + start, cmd_index - start);
+			cmd_index -= start;
+		}
 	}
 
 #ifdef DEBUG_RECEPTION
@@ -617,50 +884,92 @@ int receive_command(int socket, char *buffer) {
 	PRINT_VERBOSE("\tElement is '%s'\n", buffer);
 #endif
 
-	/* if only this message was in the buffer we're done */
-	if(stop == cmd_index-1) {
-		cmd_index = 0;
-	} else {
-		/* check if there is a '<' after the stop */
-		start = -1;
-		for(i=stop;i<cmd_index;i++) {
-			if(cmd_buffer[i] == '<') {
-				start = i;
-				break;
-			}
-		}
+	/*
+	 * Keep everything behind the element in the buffer. The element may be
+	 * followed by raw data fetched with receive_data(). Garbage in front of
+	 * the next element is skipped with the next call.
+	 */
+	TRACE2(command, buffer, stop - start + 1);
+	consume_buffer(stop + 1);
+	conn_stats->commands++;
+	latency_command();
 
-		/* if there is none it is only garbage we can remove */
-		if(start == -1) {
-			cmd_index = 0;
-#ifdef DEBUG_RECEPTION
-			PRINT_VERBOSE("\tGarbage after the first element in the buffer\n");
-#endif
-			return 0;
-			/* otherwise we copy the valid data to the beginning of the buffer */
-		} else {
-			for(i=start;i<cmd_index;i++) {
-				cmd_buffer[i-start] = cmd_buffer[i];
-			}
-			cmd_index -= start;
+	return 0;
+}
 
-			/* check if there is at least one full element in the buffer */
-			stop = -1;
-			for(i=1;i<cmd_index;i++) {
-				if(cmd_buffer[i] == '>') {
-					stop = i;
-					break;
-				}
-			}
+/*
+ * sends data to the client and accounts the time spent in send() and the
+ * fill level of the socket send queue (sampled every OUTQ_SAMPLE calls)
+ */
+int client_send(const void *buf, int len, int flags) {
+	static unsigned int calls;
+	struct timespec start, end;
+	int ret, outq;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = send(client_socket, buf, len, flags);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	conn_stats->send_blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000LL +
+		(end.tv_nsec - start.tv_nsec);
+	TRACE3(client_send, len, ret, (end.tv_sec - start.tv_sec) * 1000000000LL +
+	       (end.tv_nsec - start.tv_nsec));
+
+	if(ret > 0)
+		conn_stats->client_tx_bytes += ret;
+
+	if((++calls % OUTQ_SAMPLE) == 0 && ioctl(client_socket, SIOCOUTQ, &outq) == 0 &&
+	   outq > conn_stats->outq_max)
+		conn_stats->outq_max = outq;
 
-			if(stop != -1) {
-				more_elements = 1;
+	return ret;
+}
+
+/* removes len bytes from the command buffer and checks for further elements */
+static void consume_buffer(int len) {
+	int i, start;
+
+	memmove(cmd_buffer, cmd_buffer + len, cmd_index - len);
+	cmd_index -= len;
+
+	/* check if there is at least one full element in the buffer */
+	more_elements = 0;
+	start = -1;
+	for(i=0;i<cmd_index;i++) {
+		if(start == -1 && cmd_buffer[i] == '<')
+			start = i;
+		else if(start != -1 && cmd_buffer[i] == '>') {
+			more_elements = 1;
 #ifdef DEBUG_RECEPTION
-				PRINT_VERBOSE("\tMore than one full element in the buffer.\n");
+			PRINT_VERBOSE("\tMore than one full element in the buffer.\n");
 #endif
-			}
+			break;
 		}
 	}
+}
+
+/*
+ * reads len bytes of raw data following the last received element, e.g. a
+ * binary PDU. Data already in the command buffer is used first.
+ * returns '-1' if the connection was terminated.
+ */
+int receive_data(int socket, char *buffer, int len) {
+	int ret, copied;
+
+	copied = (cmd_index < len) ? cmd_index : len;
+	memcpy(buffer, cmd_buffer, copied);
+	consume_buffer(copied);
+
+	while(copied < len) {
+		ret = read(socket, buffer + copied, len - copied);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		copied += ret;
+		conn_stats->client_rx_bytes += ret;
+	}
+
 	return 0;
 }
 
@@ -700,32 +1009,135 @@ void determine_adress() {
 void print_usage(void) {
 	printf("%s Version %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 	printf("Report bugs to %s\n\n", PACKAGE_BUGREPORT);
-	printf("Usage: socketcand [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-p port | --port port] [-l interface | --listen interface]\n\t\t[-u name | --afuxname name] [-n | --no-beacon] [-d | --daemon]\n\t\t[-h | --help]\n\n");
+	printf("Usage: socketcand [-v | --verbose] [-i interfaces | --interfaces interfaces]\n\t\t[-p port | --port port] [-l interface | --listen interface]\n\t\t[-u name | --afuxname name] [-a addrs | --address addrs]\n\t\t[--backlog n] [--acceptors n] [--workers n]\n\t\t[-n | --no-beacon] [-d | --daemon]\n\t\t[-t secs | --session-timeout secs] [-f dir | --flash-dir dir]\n\t\t[-m addr | --metrics addr] [-b mode | --beacon mode]\n\t\t[--beacon-ttl ttl] [--beacon-interval secs] [-h | --help]\n\n");
 	printf("Options:\n");
 	printf("\t-v (activates verbose output to STDOUT)\n");
 	printf("\t-i <interfaces> (comma separated list of SocketCAN interfaces the daemon\n\t\tshall provide access to e.g. '-i can0,vcan1' - default: %s)\n", DEFAULT_BUSNAME);
 	printf("\t-p <port> (changes the default port '%d' the daemon is listening at)\n", PORT);
 	printf("\t-l <interface> (changes the default network interface the daemon will\n\t\tbind to - default: %s)\n", DEFAULT_INTERFACE);
 	printf("\t-u <name> (the AF_UNIX socket path - abstract name when leading '/' is missing)\n\t\t(N.B. the AF_UNIX binding will supersede the port/interface settings)\n");
+	printf("\t-a <addrs> (comma separated listen addresses, e.g.\n\t\t'0.0.0.0:29536,[::]:29536,/run/socketcand' - supersedes -l, -p and -u)\n");
+	printf("\t--backlog <n> (length of the queue of pending connections - default: %d)\n", LISTEN_BACKLOG);
+	printf("\t--acceptors <n> (processes accepting with SO_REUSEPORT, the further\n\t\tones pinned to a core - default: 1)\n");
+	printf("\t--workers <n> (keep n pre-forked idle workers that are reused for the\n\t\tconnections instead of forking for each - default: 0)\n");
 	printf("\t-n (deactivates the discovery beacon)\n");
+	printf("\t-b <mode> (discovery beacon: 'broadcast' (default), 'query' to answer\n\t\tqueries only or an IPv4/IPv6 multicast group)\n");
+	printf("\t--beacon-ttl <ttl> (TTL of multicast beacons - default: %d)\n", BEACON_TTL);
+	printf("\t--beacon-interval <secs> (beacon interval, 1 to %d - default: %d)\n", BEACON_INTERVAL_MAX, BEACON_INTERVAL);
+	printf("\t-t <secs> (time a named BCM session is kept after the client\n\t\tdisconnected - default: %d)\n", SESSION_TIMEOUT);
+	printf("\t-m <addr> (serve OpenMetrics on this TCP port of the listen address\n\t\tor AF_UNIX name - same naming rules as -u)\n");
 	printf("\t-d (set this flag if you want log to syslog instead of STDOUT)\n");
 	printf("\t-h (prints this message)\n");
 }
 
+/*
+ * Forks the process for the accepted client_socket. Children are reaped by
+ * the accept loop after the statistics slot knows the pid, so a quickly dying
+ * child is accounted. returns 0 in the child.
+ */
+int fork_client() {
+	struct client_slot *slot;
+	pid_t pid;
+
+	TRACE1(accept, client_socket);
+	slot = metrics_claim();
+	pid = fork();
+
+	if(pid == 0) {
+		listen_close();
+		listen_unpin();
+		reap_close();
+		metrics_child(slot);
+		return 0;
+	}
+
+	if(pid < 0) {
+		PRINT_ERROR("Could not fork client process %s\n", strerror(errno));
+	} else {
+		TRACE1(fork, pid);
+	}
+
+	metrics_forked(slot, pid);
+	close(client_socket);
+
+	/* the first client did not wait for the subsystems */
+	if(lazy_pending) {
+		lazy_pending = 0;
+		lazy_start();
+	}
+
+	return 1;
+}
+
+/* starts the subsystems that are not needed to accept the first connection */
+static void lazy_start() {
+	if(saddr.sin_family != AF_INET)
+		determine_adress();
+
+	statistics_collector_start();
+
+	if(!disable_beacon)
+		beacon_start();
+}
+
+/*
+ * The SIGCHLD handler only wakes the accept loop (self-pipe): the accounting
+ * of reaped children takes locks that are not async-signal-safe.
+ */
+void reap_init() {
+	reap_close();
+
+	if(pipe(reap_pipe) < 0) {
+		PRINT_ERROR("Could not create the SIGCHLD pipe %s\n", strerror(errno));
+		exit(1);
+	}
+
+	fcntl(reap_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(reap_pipe[1], F_SETFL, O_NONBLOCK);
+}
+
+/* the accounting of the children is left to the parent */
+void reap_close() {
+	if(reap_pipe[0] >= 0) {
+		close(reap_pipe[0]);
+		close(reap_pipe[1]);
+	}
+	reap_pipe[0] = reap_pipe[1] = -1;
+}
+
+void reap_children() {
+	char buf[64];
+	pid_t pid;
+
+	while(read(reap_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	/* signals are not queued - reap every child that has exited */
+	while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		metrics_reaped(pid);
+		pool_reaped(pid);
+	}
+}
+
 void childdied() {
-	wait(NULL);
+	int saved_errno = errno;
+
+	if(reap_pipe[1] >= 0 && write(reap_pipe[1], "", 1) < 0) {
+		/* full - the loop has not drained the pipe yet */
+	}
+
+	errno = saved_errno;
 }
 
 void sigint() {
+	log_signal();
+
 	if(verbose_flag)
 		PRINT_ERROR("received SIGINT\n");
 
-	if(sl != -1) {
-		if(verbose_flag)
-			PRINT_INFO("closing listening socket\n");
-		if(!close(sl))
-			sl = -1;
-	}
+	if(verbose_flag)
+		PRINT_INFO("closing listening sockets\n");
+	listen_close();
 
 	if(client_socket != -1) {
 		if(verbose_flag)
@@ -734,6 +1146,7 @@ void sigint() {
 			client_socket = -1;
 	}
 
+	log_flush();
 	closelog();
 
 	exit(0);
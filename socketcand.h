@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/time.h>
 
 /* max. length for ISO 15765-2 PDUs */
 #define ISOTPLEN 4095
@@ -19,9 +20,15 @@
 #define STATE_CONTROL 4
 #define STATE_ISOTP 5
 
-#define PRINT_INFO(...) if(daemon_flag) syslog(LOG_INFO, __VA_ARGS__); else printf(__VA_ARGS__);
-#define PRINT_ERROR(...) if(daemon_flag) syslog(LOG_ERR, __VA_ARGS__); else fprintf(stderr, __VA_ARGS__);
-#define PRINT_VERBOSE(...) if(verbose_flag && !daemon_flag) printf(__VA_ARGS__);
+/* queued for the writer thread of the process - see log.c */
+#define PRINT_INFO(...) log_message(LOG_INFO, __VA_ARGS__);
+#define PRINT_ERROR(...) log_message(LOG_ERR, __VA_ARGS__);
+#define PRINT_VERBOSE(...) if(verbose_flag && !daemon_flag) log_message(LOG_DEBUG, __VA_ARGS__);
+
+void log_init();
+void log_message(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush();
+void log_signal();
 
 #ifndef VERSION_STRING
 #define VERSION_STRING "SNAPSHOT"
@@ -29,10 +36,33 @@
 
 #undef DEBUG_RECEPTION
 
+/*
+ * A connection in ISO-TP mode can use one untagged channel configured with
+ * '< isotpconf ... >' and up to MAX_ISOTP_CHANNELS channels opened with
+ * '< isotpopen ch ... >' that carry their handle 'ch' in every PDU.
+ */
+#define MAX_ISOTP_CHANNELS 64
+#define UNTAGGED_CHANNEL MAX_ISOTP_CHANNELS
+
+/* ISO-TP timing for the channels of a bus - see '< isotptiming >' */
+struct isotp_timing {
+	unsigned int frame_txtime; /* ns */
+	unsigned int tx_stmin; /* ns, used with CAN_ISOTP_FORCE_TXSTMIN */
+	unsigned int rx_stmin; /* ns, used with CAN_ISOTP_FORCE_RXSTMIN */
+	unsigned int flags; /* added to the flags of the channel */
+};
+
 void state_bcm();
 void state_raw();
 void state_isotp();
 void state_control();
+int state_bcm_resume(char *buf);
+void state_bcm_close();
+void state_raw_close();
+void state_isotp_close();
+void state_control_close();
+void isotp_set_profile(const char *bus, struct isotp_timing *timing);
+int isotp_send_pdu(int ch, unsigned char *isobuf, int len);
 
 extern int client_socket;
 extern char **interface_names;
@@ -40,18 +70,76 @@ extern int interface_count;
 extern int port;
 extern int verbose_flag;
 extern int daemon_flag;
+extern pid_t daemon_pid;
+extern int reap_pipe[2];
 extern int state;
 extern int previous_state;
 extern char bus_name[];
 extern char* description;
+extern char* interface_string;
 extern char* afuxname;
-extern pthread_t statistics_thread;
+extern char* flash_dir;
 extern int more_elements;
 extern struct sockaddr_in broadcast_addr;
 extern struct sockaddr_in saddr;
 
+/* log-linear latency histogram in ns - see latency.c */
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (38 * LAT_SUB_BUCKETS) /* up to 2^40 ns */
+
+struct latency_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[LAT_BUCKETS];
+};
+
+void latency_record(struct latency_hist *hist, long long val);
+unsigned long long latency_bucket_limit(int idx);
+unsigned long long latency_percentile(struct latency_hist *hist, int permille);
+void latency_rx(struct timeval *tv);
+void latency_command();
+void latency_tx();
+void latency_send();
+void latency_reset();
+
+/* counters of the connection - see '< connstats >' */
+struct conn_stats {
+	unsigned long long client_rx_bytes; /* bytes received from the client */
+	unsigned long long client_tx_bytes; /* bytes sent to the client */
+	unsigned long long can_rx; /* CAN frames and PDUs forwarded to the client */
+	unsigned long long can_tx; /* CAN frames and PDUs sent to the bus */
+	unsigned long long commands; /* received command elements */
+	unsigned long long parse_errors;
+	unsigned long long can_tx_errors;
+	unsigned long long can_drops; /* frames dropped by the kernel (RAW mode) */
+	unsigned long long outq_max; /* high-water mark of the client socket send queue */
+	unsigned long long send_blocked_ns; /* time spent in send() to the client */
+	unsigned long long log_suppressed; /* log lines dropped by the rate limit or a full ring */
+	struct latency_hist rx_latency; /* bus to client */
+	struct latency_hist tx_latency; /* client command to bus */
+};
+
+#define OUTQ_SAMPLE 16 /* sample the send queue of the client every n sends */
+
+extern struct conn_stats *conn_stats;
+
+int client_send(const void *buf, int len, int flags);
+void handle_client();
+void client_reset();
+int bus_ifindex(const char *bus);
+void bus_ifindex_flush();
+void reap_init();
+void reap_children();
+void reap_close();
 int receive_command(int socket, char *buf);
+int receive_data(int socket, char *buf, int len);
 int state_changed(char *buf, int current_state);
 char *element_start(char *buf, int element);
 int element_length(char *buf, int element);
 int asc2nibble(char c);
+int hex_encode(char *dst, const unsigned char *src, int len);
+int hex_decode(unsigned char *dst, const char *src, int len);
+int base64_encode(char *dst, const unsigned char *src, int len);
+int base64_decode(unsigned char *dst, const char *src, int len);
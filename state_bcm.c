@@ -1,6 +1,8 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "session.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,28 +25,125 @@
 #include <linux/can/error.h>
 #include <linux/sockios.h>
 
-#define RXLEN 128
+#define RXLEN 256
 
 int sc = -1;
 fd_set readfds;
 struct timeval tv;
 
+/* valid CAN FD payload lengths (the DLC values 9..15 map to 12..64 bytes) */
+static int valid_fd_len(unsigned long len) {
+	if(len <= 8)
+		return 1;
+
+	return len == 12 || len == 16 || len == 20 || len == 24 ||
+		len == 32 || len == 48 || len == 64;
+}
+
+/*
+ * Reads len space separated ASCII hex bytes into data. Returns a pointer
+ * behind the last byte or NULL on syntax errors.
+ */
+static char *parse_data(char *ptr, unsigned char *data, int len) {
+	int i;
+	char *end;
+	unsigned long val;
+
+	for (i = 0; i < len; i++) {
+		val = strtoul(ptr, &end, 16);
+		if (end == ptr || val > 0xFF)
+			return NULL;
+		data[i] = val;
+		ptr = end;
+	}
+	return ptr;
+}
+
+/*
+ * Parses the frame part of a command starting at the given element:
+ * classic CAN: 'can_dlc [data]* >' - CAN FD: 'flags len [data]* >'
+ */
+static int parse_frame(char *buf, int element, int fd, struct canfd_frame *frame) {
+	char *ptr = element_start(buf, element);
+	char *end;
+	unsigned long val;
+
+	if (ptr == NULL)
+		return -1;
+
+	if (fd) {
+		val = strtoul(ptr, &end, 16);
+		if (end == ptr || val > 0xFF)
+			return -1;
+		frame->flags = val;
+		ptr = end;
+	}
+
+	val = strtoul(ptr, &end, 10);
+	if (end == ptr || (fd ? !valid_fd_len(val) : val > CAN_MAX_DLEN))
+		return -1;
+
+	frame->len = val;
+
+	ptr = parse_data(end, frame->data, frame->len);
+	if (ptr == NULL)
+		return -1;
+
+	/* nothing but the closing bracket may follow */
+	while (*ptr == ' ')
+		ptr++;
+
+	return (*ptr == '>') ? 0 : -1;
+}
+
+/* send a BCM message to the currently opened bus */
+static int bcm_send(void *msg, size_t len) {
+	struct sockaddr_can caddr;
+	int ret;
+
+	memset(&caddr, 0, sizeof(caddr));
+	caddr.can_family = PF_CAN;
+	caddr.can_ifindex = bus_ifindex(bus_name);
+	if (caddr.can_ifindex == 0)
+		return -1;
+
+	ret = sendto(sc, msg, len, 0, (struct sockaddr*)&caddr, sizeof(caddr));
+	if (ret < 0) {
+		conn_stats->can_tx_errors++;
+		/* the interface has been removed or recreated */
+		if (errno == ENODEV)
+			bus_ifindex_flush();
+	}
+
+	return ret;
+}
+
+/* releases the BCM socket and the session when the connection has ended */
+void state_bcm_close() {
+	if(sc >= 0)
+		close(sc);
+	sc = -1;
+
+	session_clear_jobs();
+	session_name[0] = '\0';
+}
+
 void state_bcm() {
-	int i, j, ret;
+	int i, ret;
 	struct sockaddr_can caddr;
 	socklen_t caddrlen = sizeof(caddr);
-	struct ifreq ifr;
 	char rxmsg[RXLEN];
 	char buf[MAXLEN];
 
+	/* classic CAN frames are sent with the first CAN_MTU bytes of struct canfd_frame */
 	struct {
 		struct bcm_msg_head msg_head;
-		struct can_frame frame;
+		struct canfd_frame frame;
 	} msg;
 
 	struct {
 		struct bcm_msg_head msg_head;
-		struct can_frame frame[257]; /* MAX_NFRAMES + MUX MASK */
+		struct canfd_frame frame[257]; /* MAX_NFRAMES + MUX MASK */
 	} muxmsg;
 
 	if(previous_state != STATE_BCM) {
@@ -92,6 +191,10 @@ void state_bcm() {
 
 		ret = recvfrom(sc, &msg, sizeof(msg), 0,
 			       (struct sockaddr*)&caddr, &caddrlen);
+		if (ret > 0) {
+			conn_stats->can_rx++;
+			TRACE3(can_rx, STATE_BCM, msg.msg_head.can_id, msg.frame.len);
+		}
 
 		/* read timestamp data */
 		if(ioctl(sc, SIOCGSTAMP, &tv) < 0) {
@@ -100,83 +203,132 @@ void state_bcm() {
 
 		/* Check if this is an error frame */
 		if(msg.msg_head.can_id & CAN_ERR_FLAG) {
-			if(msg.frame.can_dlc != CAN_ERR_DLC) {
+			if(msg.frame.len != CAN_ERR_DLC) {
 				PRINT_ERROR("Error frame has a wrong DLC!\n")
 					} else {
 				snprintf(rxmsg, RXLEN, "< error %03X %ld.%06ld ", msg.msg_head.can_id, tv.tv_sec, tv.tv_usec);
 
-				for ( i = 0; i < msg.frame.can_dlc; i++)
+				for ( i = 0; i < msg.frame.len; i++)
 					snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "%02X ",
 						 msg.frame.data[i]);
 
 				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), " >");
-				send(client_socket, rxmsg, strlen(rxmsg), 0);
+				client_send(rxmsg, strlen(rxmsg), 0);
 			}
 		} else {
+			char *frametype = "frame";
+			int len = msg.frame.len;
+
+			/* CAN FD frames additionally carry the flags (e.g. BRS/ESI) */
+			if(msg.msg_head.flags & CAN_FD_FRAME) {
+				frametype = "fdframe";
+				if(len > CANFD_MAX_DLEN)
+					len = CANFD_MAX_DLEN;
+			} else if(len > CAN_MAX_DLEN) {
+				len = CAN_MAX_DLEN;
+			}
+
 			if(msg.msg_head.can_id & CAN_EFF_FLAG) {
-				snprintf(rxmsg, RXLEN, "< frame %08X %ld.%06ld ",
+				snprintf(rxmsg, RXLEN, "< %s %08X %ld.%06ld ", frametype,
 					 msg.msg_head.can_id & CAN_EFF_MASK, tv.tv_sec, tv.tv_usec);
 			} else {
-				snprintf(rxmsg, RXLEN, "< frame %03X %ld.%06ld ",
+				snprintf(rxmsg, RXLEN, "< %s %03X %ld.%06ld ", frametype,
 					 msg.msg_head.can_id & CAN_SFF_MASK, tv.tv_sec, tv.tv_usec);
 			}
 
-			for ( i = 0; i < msg.frame.can_dlc; i++)
+			if(msg.msg_head.flags & CAN_FD_FRAME)
+				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "%02X ",
+					 msg.frame.flags);
+
+			for ( i = 0; i < len; i++)
 				snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), "%02X ",
 					 msg.frame.data[i]);
 
 			snprintf(rxmsg + strlen(rxmsg), RXLEN - strlen(rxmsg), " >");
-			send(client_socket, rxmsg, strlen(rxmsg), 0);
+			client_send(rxmsg, strlen(rxmsg), 0);
+			latency_rx(&tv);
 		}
 	}
 
 	if (FD_ISSET(client_socket, &readfds)) {
-		int items;
+		int items, fd, kind;
+		size_t msglen;
+		char *cmd;
 
 		ret = receive_command(client_socket, buf);
 
 		if(ret != 0) {
+			/* keep the BCM jobs of a named session for a reconnecting client */
+			if(session_name[0])
+				session_linger(sc);
 			state = STATE_SHUTDOWN;
 			return;
 		}
 
-		/* prepare bcm message settings */
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_head.nframes = 1;
-
-		strncpy(ifr.ifr_name, bus_name, IFNAMSIZ);
-
 		if (state_changed(buf, state)) {
 			close(sc);
+			sc = -1;
+			session_clear_jobs();
 			strcpy(buf, "< ok >");
-			send(client_socket, buf, strlen(buf), 0);
+			client_send(buf, strlen(buf), 0);
 			return;
 		}
 
 		if(!strcmp("< echo >", buf)) {
-			send(client_socket, buf, strlen(buf), 0);
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
+
+		/* Name the session to keep the BCM jobs after a disconnect */
+		if(!strncmp("< session ", buf, 10)) {
+			char name[SESSION_NAME_LEN];
+
+			items = sscanf(buf, "< %*s %32s >", name);
+			if (items != 1 || session_set_name(name) < 0) {
+				conn_stats->parse_errors++;
+				PRINT_ERROR("Syntax error in session command\n")
+					strcpy(buf, "< error invalid session name >");
+			} else {
+				strcpy(buf, "< ok >");
+			}
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
+
+		/* Take over the BCM socket of a lingering session */
+		if(!strncmp("< resume ", buf, 9)) {
+			if(state_bcm_resume(buf) < 0) {
+				strcpy(buf, "< error could not resume session >");
+				client_send(buf, strlen(buf), 0);
+			}
 			return;
 		}
 
+		/*
+		 * Every command is available for CAN FD with a leading 'fd', e.g.
+		 * '< fdsend ... >'. These commands set the CAN_FD_FRAME flag and
+		 * operate on struct canfd_frame with up to 64 bytes of payload.
+		 */
+		fd = !strncmp("< fd", buf, 4);
+		cmd = buf + (fd ? 4 : 2);
+
+		/* prepare bcm message settings */
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_head.nframes = 1;
+		if (fd)
+			msg.msg_head.flags = CAN_FD_FRAME;
+
+		msglen = sizeof(struct bcm_msg_head) + (fd ? CANFD_MTU : CAN_MTU);
+		kind = fd ? SESSION_JOB_FD : 0;
+
 		/* Send a single frame */
-		if(!strncmp("< send ", buf, 7)) {
-			items = sscanf(buf, "< %*s %x %hhu "
-				       "%hhx %hhx %hhx %hhx %hhx %hhx "
-				       "%hhx %hhx >",
-				       &msg.msg_head.can_id,
-				       &msg.frame.can_dlc,
-				       &msg.frame.data[0],
-				       &msg.frame.data[1],
-				       &msg.frame.data[2],
-				       &msg.frame.data[3],
-				       &msg.frame.data[4],
-				       &msg.frame.data[5],
-				       &msg.frame.data[6],
-				       &msg.frame.data[7]);
-
-			if ( (items < 2) ||
-			     (msg.frame.can_dlc > 8) ||
-			     (items != 2 + msg.frame.can_dlc)) {
+		if(!strncmp("send ", cmd, 5)) {
+			items = sscanf(buf, "< %*s %x ",
+				       &msg.msg_head.can_id);
+
+			if ( (items != 1) ||
+			     parse_frame(buf, 3, fd, &msg.frame) < 0) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("Syntax error in send command\n")
 					return;
 			}
@@ -188,32 +340,21 @@ void state_bcm() {
 			msg.msg_head.opcode = TX_SEND;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
+			if (bcm_send(&msg, msglen) > 0) {
+				conn_stats->can_tx++;
+				TRACE3(can_tx, STATE_BCM, msg.frame.can_id, msg.frame.len);
+				latency_tx();
 			}
 			/* Add a send job */
-		} else if(!strncmp("< add ", buf, 6)) {
-			items = sscanf(buf, "< %*s %lu %lu %x %hhu "
-				       "%hhx %hhx %hhx %hhx %hhx %hhx "
-				       "%hhx %hhx >",
+		} else if(!strncmp("add ", cmd, 4)) {
+			items = sscanf(buf, "< %*s %lu %lu %x ",
 				       &msg.msg_head.ival2.tv_sec,
 				       &msg.msg_head.ival2.tv_usec,
-				       &msg.msg_head.can_id,
-				       &msg.frame.can_dlc,
-				       &msg.frame.data[0],
-				       &msg.frame.data[1],
-				       &msg.frame.data[2],
-				       &msg.frame.data[3],
-				       &msg.frame.data[4],
-				       &msg.frame.data[5],
-				       &msg.frame.data[6],
-				       &msg.frame.data[7]);
-
-			if( (items < 4) ||
-			    (msg.frame.can_dlc > 8) ||
-			    (items != 4 + msg.frame.can_dlc) ) {
+				       &msg.msg_head.can_id);
+
+			if( (items != 3) ||
+			    parse_frame(buf, 5, fd, &msg.frame) < 0) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("Syntax error in add command.\n");
 				return;
 			}
@@ -226,30 +367,17 @@ void state_bcm() {
 			msg.msg_head.flags |= SETTIMER | STARTTIMER;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+			if (bcm_send(&msg, msglen) > 0)
+				session_add_job(kind | SESSION_JOB_TX, msg.msg_head.can_id,
+						&msg.msg_head.ival2, buf);
 			/* Update send job */
-		} else if(!strncmp("< update ", buf, 9)) {
-			items = sscanf(buf, "< %*s %x %hhu "
-				       "%hhx %hhx %hhx %hhx %hhx %hhx "
-				       "%hhx %hhx >",
-				       &msg.msg_head.can_id,
-				       &msg.frame.can_dlc,
-				       &msg.frame.data[0],
-				       &msg.frame.data[1],
-				       &msg.frame.data[2],
-				       &msg.frame.data[3],
-				       &msg.frame.data[4],
-				       &msg.frame.data[5],
-				       &msg.frame.data[6],
-				       &msg.frame.data[7]);
-
-			if ( (items < 2) ||
-			     (msg.frame.can_dlc > 8) ||
-			     (items != 2 + msg.frame.can_dlc)) {
+		} else if(!strncmp("update ", cmd, 7)) {
+			items = sscanf(buf, "< %*s %x ",
+				       &msg.msg_head.can_id);
+
+			if ( (items != 1) ||
+			     parse_frame(buf, 3, fd, &msg.frame) < 0) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("Syntax error in update send job command\n")
 					return;
 			}
@@ -259,20 +387,17 @@ void state_bcm() {
 				msg.msg_head.can_id |= CAN_EFF_FLAG;
 
 			msg.msg_head.opcode = TX_SETUP;
-			msg.msg_head.flags  = 0;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+			if (bcm_send(&msg, msglen) > 0)
+				session_update_job(kind | SESSION_JOB_TX, msg.msg_head.can_id, buf);
 			/* Delete a send job */
-		} else if(!strncmp("< delete ", buf, 9)) {
+		} else if(!strncmp("delete ", cmd, 7)) {
 			items = sscanf(buf, "< %*s %x >",
 				       &msg.msg_head.can_id);
 
 			if (items != 1)  {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("Syntax error in delete job command\n")
 					return;
 			}
@@ -284,32 +409,18 @@ void state_bcm() {
 			msg.msg_head.opcode = TX_DELETE;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+			bcm_send(&msg, msglen);
+			session_delete_job(kind | SESSION_JOB_TX, msg.msg_head.can_id);
 			/* Receive CAN ID with content matching */
-		} else if(!strncmp("< filter ", buf, 9)) {
-			items = sscanf(buf, "< %*s %lu %lu %x %hhu "
-				       "%hhx %hhx %hhx %hhx %hhx %hhx "
-				       "%hhx %hhx >",
+		} else if(!strncmp("filter ", cmd, 7)) {
+			items = sscanf(buf, "< %*s %lu %lu %x ",
 				       &msg.msg_head.ival2.tv_sec,
 				       &msg.msg_head.ival2.tv_usec,
-				       &msg.msg_head.can_id,
-				       &msg.frame.can_dlc,
-				       &msg.frame.data[0],
-				       &msg.frame.data[1],
-				       &msg.frame.data[2],
-				       &msg.frame.data[3],
-				       &msg.frame.data[4],
-				       &msg.frame.data[5],
-				       &msg.frame.data[6],
-				       &msg.frame.data[7]);
-
-			if( (items < 4) ||
-			    (msg.frame.can_dlc > 8) ||
-			    (items != 4 + msg.frame.can_dlc) ) {
+				       &msg.msg_head.can_id);
+
+			if( (items != 3) ||
+			    parse_frame(buf, 5, fd, &msg.frame) < 0) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("syntax error in filter command.\n")
 					return;
 			}
@@ -319,19 +430,17 @@ void state_bcm() {
 				msg.msg_head.can_id |= CAN_EFF_FLAG;
 
 			msg.msg_head.opcode = RX_SETUP;
-			msg.msg_head.flags  = SETTIMER;
+			msg.msg_head.flags |= SETTIMER;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+			if (bcm_send(&msg, msglen) > 0)
+				session_add_job(kind | SESSION_JOB_RX, msg.msg_head.can_id,
+						&msg.msg_head.ival2, buf);
 			/* Receive CAN ID with multiplex content matching */
-		} else if(!strncmp("< muxfilter ", buf, 12)) {
+		} else if(!strncmp("muxfilter ", cmd, 10)) {
 
 			char *cfptr;
-			char tmp;
+			int len = CAN_MAX_DLEN;
 
 			memset(&muxmsg, 0, sizeof(muxmsg));
 
@@ -341,9 +450,16 @@ void state_bcm() {
 				       &muxmsg.msg_head.can_id,
 				       &muxmsg.msg_head.nframes);
 
+			/* < fdmuxfilter sec usec can_id nframes len ... > has the tuple length */
+			if (fd && (element_start(buf, 6) == NULL ||
+				   sscanf(element_start(buf, 6), "%d ", &len) != 1))
+				items = 0;
+
 			if( (items != 4) ||
 			    (muxmsg.msg_head.nframes < 2) ||
-			    (muxmsg.msg_head.nframes > 257) ) {
+			    (muxmsg.msg_head.nframes > 257) ||
+			    (fd && !valid_fd_len(len)) ) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("syntax error in muxfilter command.\n")
 					return;
 			}
@@ -354,55 +470,52 @@ void state_bcm() {
 
 			muxmsg.msg_head.opcode = RX_SETUP;
 			muxmsg.msg_head.flags  = SETTIMER;
+			if (fd)
+				muxmsg.msg_head.flags |= CAN_FD_FRAME;
 
-			cfptr = element_start(buf, 6);
+			cfptr = element_start(buf, fd ? 7 : 6);
 			if (cfptr == NULL) {
 				PRINT_ERROR("failed to find filter data start in muxfilter.\n")
 					return;
 			}
 
-			if (strlen(cfptr) <  muxmsg.msg_head.nframes * 24) {
+			/* every data byte takes at least two hex digits and a separator */
+			if (strlen(cfptr) < muxmsg.msg_head.nframes * len * 3) {
 				PRINT_ERROR("muxfilter data too short.\n")
 					return;
 			}
 
 			/* copy filter data and mux mask in muxmsg.frame[0] */
 			for (i = 0; i < muxmsg.msg_head.nframes; i++) {
-
-				for (j = 0; j < 8; j++) {
-
-					tmp = asc2nibble(cfptr[(24*i + 3*j)]);
-					if (tmp > 0x0F) {
-						PRINT_ERROR("failed to process filter data in muxfilter.\n")
-							return;
-					}
-
-					muxmsg.frame[i].data[j] = (tmp << 4);
-
-					tmp = asc2nibble(cfptr[(24*i + 3*j)+1]);
-					if (tmp > 0x0F) {
-						PRINT_ERROR("failed to process filter data in muxfilter.\n")
-							return;
-					}
-
-					muxmsg.frame[i].data[j] |= tmp;
+				muxmsg.frame[i].len = len;
+				cfptr = parse_data(cfptr, muxmsg.frame[i].data, len);
+				if (cfptr == NULL) {
+					PRINT_ERROR("failed to process filter data in muxfilter.\n")
+						return;
 				}
 			}
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &muxmsg, sizeof(struct bcm_msg_head) +
-				       sizeof(struct can_frame) * muxmsg.msg_head.nframes,
-				       0, (struct sockaddr*)&caddr, sizeof(caddr));
+			/* classic CAN frames are packed as struct can_frame */
+			if (!fd) {
+				struct can_frame *cf = (struct can_frame *)muxmsg.frame;
+
+				for (i = 0; i < muxmsg.msg_head.nframes; i++)
+					memmove(&cf[i], &muxmsg.frame[i], CAN_MTU);
 			}
+
+			if (bcm_send(&muxmsg, sizeof(struct bcm_msg_head) +
+				     (fd ? CANFD_MTU : CAN_MTU) * muxmsg.msg_head.nframes) > 0)
+				session_add_job(kind | SESSION_JOB_RX, muxmsg.msg_head.can_id,
+						&muxmsg.msg_head.ival2, buf);
 			/* Add a filter */
-		} else if(!strncmp("< subscribe ", buf, 12)) {
+		} else if(!strncmp("subscribe ", cmd, 10)) {
 			items = sscanf(buf, "< %*s %lu %lu %x >",
 				       &msg.msg_head.ival2.tv_sec,
 				       &msg.msg_head.ival2.tv_usec,
 				       &msg.msg_head.can_id);
 
 			if (items != 3) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("syntax error in subscribe command\n")
 					return;
 			}
@@ -412,20 +525,19 @@ void state_bcm() {
 				msg.msg_head.can_id |= CAN_EFF_FLAG;
 
 			msg.msg_head.opcode = RX_SETUP;
-			msg.msg_head.flags  = RX_FILTER_ID | SETTIMER;
+			msg.msg_head.flags |= RX_FILTER_ID | SETTIMER;
 			msg.frame.can_id = msg.msg_head.can_id;
 
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+			if (bcm_send(&msg, msglen) > 0)
+				session_add_job(kind | SESSION_JOB_RX, msg.msg_head.can_id,
+						&msg.msg_head.ival2, buf);
 			/* Delete filter */
-		} else if(!strncmp("< unsubscribe ", buf, 14)) {
+		} else if(!strncmp("unsubscribe ", cmd, 12)) {
 			items = sscanf(buf, "< %*s %x >",
 				       &msg.msg_head.can_id);
 
 			if (items != 1) {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("syntax error in unsubscribe command\n")
 					return;
 			}
@@ -436,16 +548,67 @@ void state_bcm() {
 
 			msg.msg_head.opcode = RX_DELETE;
 			msg.frame.can_id = msg.msg_head.can_id;
-            
-			if (!ioctl(sc, SIOCGIFINDEX, &ifr)) {
-				caddr.can_ifindex = ifr.ifr_ifindex;
-				sendto(sc, &msg, sizeof(msg), 0,
-				       (struct sockaddr*)&caddr, sizeof(caddr));
-			}
+
+			bcm_send(&msg, msglen);
+			session_delete_job(kind | SESSION_JOB_RX, msg.msg_head.can_id);
 		} else {
+			conn_stats->parse_errors++;
 			PRINT_ERROR("unknown command '%s'.\n", buf)
 				strcpy(buf, "< error unknown command >");
-			send(client_socket, buf, strlen(buf), 0);
+			client_send(buf, strlen(buf), 0);
 		}
 	}
 }
+
+/*
+ * '< resume NAME >' - take over the BCM socket of a lingering session and
+ * report its jobs to the client. Usable in NO_BUS and BCM mode.
+ */
+int state_bcm_resume(char *buf) {
+	int fd, i, found;
+	char name[SESSION_NAME_LEN];
+	char old_bus_name[MAX_BUSNAME];
+
+	if (sscanf(buf, "< %*s %32s >", name) != 1) {
+		conn_stats->parse_errors++;
+		PRINT_ERROR("Syntax error in resume command\n");
+		return -1;
+	}
+
+	strcpy(old_bus_name, bus_name);
+	fd = session_resume(name);
+	if (fd < 0) {
+		PRINT_INFO("could not resume session '%s'\n", name);
+		return -1;
+	}
+
+	/* check if access to the bus of the session is allowed */
+	found = 0;
+	for(i=0;i<interface_count;i++) {
+		if(!strcmp(interface_names[i], bus_name))
+			found = 1;
+	}
+
+	if(!found) {
+		PRINT_INFO("client tried to resume session on unauthorized bus.\n");
+		close(fd);
+		session_clear_jobs();
+		session_name[0] = '\0';
+		strcpy(bus_name, old_bus_name);
+		return -1;
+	}
+
+	/* the jobs of the current BCM socket are replaced by the resumed ones */
+	if (previous_state == STATE_BCM)
+		close(sc);
+
+	sc = fd;
+	previous_state = STATE_BCM;
+	state = STATE_BCM;
+
+	session_send_jobs();
+	strcpy(buf, "< ok >");
+	client_send(buf, strlen(buf), 0);
+
+	return 0;
+}
@@ -1,50 +1,140 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "metrics.h"
+#include "profiler.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <pthread.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
+#include <sys/select.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+static int timer_fd = -1;
+static int connstats_fd = -1; /* periodic '< connstats >' */
+static int connstats_ival = 0;
+static int canstate_fd = -1; /* link notifications */
+
+static void control_close() {
+	statistics_timer_close(timer_fd);
+	close(connstats_fd);
+	close(canstate_fd);
+	timer_fd = connstats_fd = canstate_fd = -1;
+	profiler_stop();
+	metrics_client_ival(0);
+}
+
+/* drops the timers and the profile when the connection has ended */
+void state_control_close() {
+	control_close();
+	statistics_ival = 0;
+	connstats_ival = 0;
+	profiler_reset();
+}
+
 void state_control() {
 	char buf[MAXLEN];
-	int i, items;
+	int i, items, ret, maxfd;
+	fd_set readfds;
 
 	if(previous_state != STATE_CONTROL) {
-		PRINT_VERBOSE("starting statistics thread...\n")
-			pthread_create(&statistics_thread, NULL, &statistics_loop, NULL);
+		if((timer_fd = statistics_timer_open()) < 0 ||
+		   (connstats_fd = statistics_timer_open()) < 0 ||
+		   (canstate_fd = canstate_open()) < 0) {
+			state = STATE_SHUTDOWN;
+			return;
+		}
+		statistics_timer_set(timer_fd, statistics_ival);
+		statistics_timer_set(connstats_fd, connstats_ival);
+		metrics_client_ival(statistics_ival);
+		canstate_request(canstate_fd);
 
 		previous_state = STATE_CONTROL;
 	}
 
+	FD_ZERO(&readfds);
+	FD_SET(timer_fd, &readfds);
+	FD_SET(connstats_fd, &readfds);
+	FD_SET(canstate_fd, &readfds);
+	if(profiler_fd() >= 0)
+		FD_SET(profiler_fd(), &readfds);
+	FD_SET(client_socket, &readfds);
+
+	/*
+	 * Check if there are more elements in the element buffer before calling select() and
+	 * blocking for new packets.
+	 */
+	if(more_elements) {
+		FD_CLR(timer_fd, &readfds);
+		FD_CLR(connstats_fd, &readfds);
+		FD_CLR(canstate_fd, &readfds);
+		if(profiler_fd() >= 0)
+			FD_CLR(profiler_fd(), &readfds);
+	} else {
+		maxfd = (timer_fd > client_socket)?timer_fd:client_socket;
+		if(connstats_fd > maxfd)
+			maxfd = connstats_fd;
+		if(canstate_fd > maxfd)
+			maxfd = canstate_fd;
+		if(profiler_fd() > maxfd)
+			maxfd = profiler_fd();
+
+		ret = select(maxfd+1, &readfds, NULL, NULL, NULL);
+
+		if(ret < 0) {
+			if(errno == EINTR)
+				return;
+			PRINT_ERROR("Error in select()\n")
+				state = STATE_SHUTDOWN;
+			return;
+		}
+	}
+
+	if(FD_ISSET(timer_fd, &readfds)) {
+		statistics_fire(timer_fd);
+		canstate_request(canstate_fd);
+	}
+
+	if(FD_ISSET(canstate_fd, &readfds))
+		canstate_receive(canstate_fd);
+
+	if(profiler_fd() >= 0 && FD_ISSET(profiler_fd(), &readfds))
+		profiler_receive();
+
+	if(FD_ISSET(connstats_fd, &readfds) && statistics_timer_expired(connstats_fd))
+		connstats_send();
+
+	if(!FD_ISSET(client_socket, &readfds))
+		return;
+
 	i = receive_command(client_socket, (char *) &buf);
 
 	if(i != 0) {
 		PRINT_ERROR("Connection terminated while waiting for command.\n");
+		control_close();
 		state = STATE_SHUTDOWN;
 		return;
 	}
 
 	if (state_changed(buf, state)) {
-		pthread_cancel(statistics_thread);
+		control_close();
 		strcpy(buf, "< ok >");
-		send(client_socket, buf, strlen(buf), 0);
+		client_send(buf, strlen(buf), 0);
 		return;
 	}
 
 	if(!strcmp("< echo >", buf)) {
-		send(client_socket, buf, strlen(buf), 0);
+		client_send(buf, strlen(buf), 0);
 		return;
 	}
 
@@ -53,13 +143,45 @@ void state_control() {
 			       &i);
 
 		if (items != 1) {
+			conn_stats->parse_errors++;
 			PRINT_ERROR("Syntax error in statistics command\n")
 				} else {
 			statistics_ival = i;
+			statistics_timer_set(timer_fd, statistics_ival);
+			metrics_client_ival(statistics_ival);
+		}
+	} else if(!strcmp("< latency >", buf)) {
+		latency_send();
+	} else if(!strcmp("< latency reset >", buf)) {
+		latency_reset();
+	} else if(!strcmp("< profile start >", buf)) {
+		if(profiler_start(bus_name) < 0) {
+			strcpy(buf, "< error could not start profiler >");
+			client_send(buf, strlen(buf), 0);
+		}
+	} else if(!strcmp("< profile stop >", buf)) {
+		profiler_stop();
+	} else if(!strcmp("< profile report >", buf)) {
+		profiler_report();
+	} else if(!strcmp("< profile reset >", buf)) {
+		profiler_reset();
+	} else if(!strcmp("< connstats >", buf)) {
+		connstats_send();
+	} else if(!strncmp("< connstats ", buf, 12)) {
+		items = sscanf(buf, "< %*s %u >",
+			       &i);
+
+		if (items != 1) {
+			conn_stats->parse_errors++;
+			PRINT_ERROR("Syntax error in connstats command\n")
+				} else {
+			connstats_ival = i;
+			statistics_timer_set(connstats_fd, connstats_ival);
 		}
 	} else {
+		conn_stats->parse_errors++;
 		PRINT_ERROR("unknown command '%s'.\n", buf)
 			strcpy(buf, "< error unknown command >");
-		send(client_socket, buf, strlen(buf), 0);
+		client_send(buf, strlen(buf), 0);
 	}
 }
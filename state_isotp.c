@@ -1,17 +1,21 @@
 #include "config.h"
 #include "socketcand.h"
+#include "uds.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -22,223 +26,866 @@
 #include <linux/can/error.h>
 #include <linux/sockios.h>
 
-int si = -1;
-fd_set readfds;
+#define CLIENT_EVENT 0xFFFFFFFF
+#define MAX_EVENTS 16
+
+/*
+ * PDUs up to ISOTP_MAXPDU bytes (ISO 15765-2:2016 32 bit length) are read
+ * into a heap buffer and forwarded to the client in chunks of PDU_CHUNK
+ * bytes. PDU_CHUNK is a multiple of 3 to keep base64 chunks unpadded.
+ */
+#define ISOTP_MAXPDU (64 * 1024)
+#define PDU_CHUNK 3072
+
+/* encoding of the PDU data on the client connection */
+#define PDU_FORMAT_HEX 0
+#define PDU_FORMAT_BASE64 1
+#define PDU_FORMAT_BINARY 2
+
+/*
+ * The ISO-TP sockets are non-blocking: a PDU is handed to the kernel with
+ * write() and the socket becomes writable (EPOLLOUT) again when the transfer
+ * including the flow control has finished. PDUs sent by the client in the
+ * meantime are queued per channel (up to ISOTP_MAXQUEUE) and written one
+ * after the other. Each finished transfer is reported with '< pdusent >'
+ * or '< chpdusent ch >'.
+ */
+#define ISOTP_MAXQUEUE 64
+
+/* values of busy */
+#define TX_CLIENT 1 /* transfer is reported to the client */
+#define TX_JOB 2 /* transfer of a UDS job request */
+
+struct isotp_pdu {
+	struct isotp_pdu *next;
+	int owner; /* TX_CLIENT or TX_JOB */
+	int len;
+	unsigned char data[];
+};
+
+struct isotp_channel {
+	int socket; /* -1 when the channel is not open */
+	int busy; /* a PDU transfer is in progress */
+	int queued;
+	struct isotp_pdu *queue_head;
+	struct isotp_pdu *queue_tail;
+	struct uds_job *job; /* UDS job running on the channel */
+};
+
+static struct isotp_channel channels[MAX_ISOTP_CHANNELS + 1];
+static int epoll_fd = -1;
+static int pdu_format = PDU_FORMAT_HEX;
+static unsigned char *isobuf; /* binary buffer for isotp sockets */
+static char isotp_bus[MAX_BUSNAME]; /* bus for new channels - see '< isotpbus >' */
+
+/*
+ * Timing profiles per bus from the configuration file. The profile of the
+ * bus is the default for the connection and can be changed with
+ * '< isotptiming ... >'. As the kernel only accepts the options before
+ * bind() the timing is applied to channels opened afterwards.
+ */
+struct isotp_profile {
+	char bus_name[MAX_BUSNAME];
+	struct isotp_timing timing;
+};
+
+static struct isotp_profile *profiles;
+static int profile_count;
+static struct isotp_timing timing;
+
+void isotp_set_profile(const char *bus, struct isotp_timing *t) {
+	struct isotp_profile *tmp;
+
+	if (strlen(bus) >= MAX_BUSNAME)
+		return;
+
+	tmp = realloc(profiles, sizeof(*profiles) * (profile_count + 1));
+	if (tmp == NULL)
+		return;
+
+	profiles = tmp;
+	strcpy(profiles[profile_count].bus_name, bus);
+	profiles[profile_count].timing = *t;
+	profile_count++;
+}
 
-void state_isotp() {
-	int i, items, ret;
+static void isotp_load_profile() {
+	int i;
+
+	memset(&timing, 0, sizeof(timing));
+
+	for (i = 0; i < profile_count; i++) {
+		if (!strcmp(profiles[i].bus_name, isotp_bus)) {
+			timing = profiles[i].timing;
+			return;
+		}
+	}
+}
+
+static void isotp_close_channel(int ch) {
+	struct isotp_pdu *pdu;
+
+	while ((pdu = channels[ch].queue_head) != NULL) {
+		channels[ch].queue_head = pdu->next;
+		free(pdu);
+	}
+	channels[ch].queue_tail = NULL;
+	channels[ch].queued = 0;
+	channels[ch].busy = 0;
+
+	uds_job_free(channels[ch].job);
+	channels[ch].job = NULL;
+
+	if (channels[ch].socket < 0)
+		return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channels[ch].socket, NULL);
+	close(channels[ch].socket);
+	channels[ch].socket = -1;
+}
+
+static void isotp_close_all() {
+	int i;
+
+	for (i = 0; i <= MAX_ISOTP_CHANNELS; i++)
+		isotp_close_channel(i);
+
+	close(epoll_fd);
+	epoll_fd = -1;
+
+	free(isobuf);
+	isobuf = NULL;
+}
+
+/*
+ * Parses the channel configuration starting at the given element:
+ * 'tx_id rx_id flags blocksize stmin [ wftmax txpad_content rxpad_content ext_address rx_ext_address
+ *  [ ll_mtu ll_tx_dl [ ll_tx_flags ] ] ]'
+ */
+static int isotp_parse_conf(char *buf, int element, struct sockaddr_can *addr,
+			    struct can_isotp_options *opts,
+			    struct can_isotp_fc_options *fcopts,
+			    struct can_isotp_ll_options *llopts) {
+	int items;
+	char *conf = element_start(buf, element);
+
+	memset(opts, 0, sizeof(*opts));
+	memset(fcopts, 0, sizeof(*fcopts));
+	memset(llopts, 0, sizeof(*llopts));
+	memset(addr, 0, sizeof(*addr));
+
+	if (conf == NULL)
+		return -1;
+
+	items = sscanf(conf, "%x %x %x "
+		       "%hhu %hhx %hhu "
+		       "%hhx %hhx %hhx %hhx "
+		       "%hhu %hhu %hhx >",
+		       &addr->can_addr.tp.tx_id,
+		       &addr->can_addr.tp.rx_id,
+		       &opts->flags,
+		       &fcopts->bs,
+		       &fcopts->stmin,
+		       &fcopts->wftmax,
+		       &opts->txpad_content,
+		       &opts->rxpad_content,
+		       &opts->ext_address,
+		       &opts->rx_ext_address,
+		       &llopts->mtu,
+		       &llopts->tx_dl,
+		       &llopts->tx_flags);
+
+	/* the link layer options need at least the MTU and tx_dl */
+	if (items == 11)
+		return -1;
+
+	/* < isotpconf XXXXXXXX ... > check for extended identifier */
+	if(element_length(buf, element) == 8)
+		addr->can_addr.tp.tx_id |= CAN_EFF_FLAG;
+
+	if(element_length(buf, element + 1) == 8)
+		addr->can_addr.tp.rx_id |= CAN_EFF_FLAG;
+
+	if ((opts->flags & CAN_ISOTP_RX_EXT_ADDR && items < 10) ||
+	    (opts->flags & CAN_ISOTP_EXTEND_ADDR && items < 9) ||
+	    (opts->flags & CAN_ISOTP_RX_PADDING && items < 8) ||
+	    (opts->flags & CAN_ISOTP_TX_PADDING && items < 7) ||
+	    (items < 5))
+		return -1;
+
+	return 0;
+}
+
+static int isotp_open_channel(int ch, struct sockaddr_can *addr,
+			      struct can_isotp_options *opts,
+			      struct can_isotp_fc_options *fcopts,
+			      struct can_isotp_ll_options *llopts) {
+	int si;
+	struct epoll_event event;
+
+	/* open ISOTP socket */
+	if ((si = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
+		PRINT_ERROR("Error while opening ISOTP socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	if((addr->can_ifindex = bus_ifindex(isotp_bus)) == 0) {
+		PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	addr->can_family = PF_CAN;
+
+	opts->flags |= timing.flags;
+	opts->frame_txtime = timing.frame_txtime;
+
+	/* only change the built-in defaults when required */
+	if (opts->flags || opts->frame_txtime)
+		setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, opts, sizeof(*opts));
 
+	if ((timing.tx_stmin &&
+	     setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_TX_STMIN, &timing.tx_stmin, sizeof(timing.tx_stmin)) < 0) ||
+	    (timing.rx_stmin &&
+	     setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_RX_STMIN, &timing.rx_stmin, sizeof(timing.rx_stmin)) < 0)) {
+		PRINT_ERROR("Error while setting ISOTP STmin %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, fcopts, sizeof(*fcopts));
+
+	/* CAN FD link layer, e.g. mtu 72 and tx_dl 64 */
+	if (llopts->mtu &&
+	    setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, llopts, sizeof(*llopts)) < 0) {
+		PRINT_ERROR("Error while setting ISOTP link layer options %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	PRINT_VERBOSE("binding ISOTP socket...\n")
+	if (bind(si, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		PRINT_ERROR("Error while binding ISOTP socket %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	if (fcntl(si, F_SETFL, fcntl(si, F_GETFL) | O_NONBLOCK) < 0) {
+		PRINT_ERROR("Error while setting ISOTP socket non-blocking %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u32 = ch;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, si, &event) < 0) {
+		PRINT_ERROR("Error while adding ISOTP socket %s\n", strerror(errno));
+		close(si);
+		return -1;
+	}
+
+	/* ok we made it and have a proper isotp socket open */
+	isotp_close_channel(ch);
+	channels[ch].socket = si;
+
+	return 0;
+}
+
+static void isotp_job_done(int ch) {
+	uds_job_free(channels[ch].job);
+	channels[ch].job = NULL;
+}
+
+/* ms until the next UDS job deadline or -1 */
+static int isotp_job_timeout() {
+	int ch, ms, timeout = -1;
+	long long now = uds_now();
+
+	for (ch = 0; ch <= MAX_ISOTP_CHANNELS; ch++) {
+		if (!channels[ch].job)
+			continue;
+
+		ms = uds_remaining(channels[ch].job, now);
+		if (ms >= 0 && (timeout < 0 || ms < timeout))
+			timeout = ms;
+	}
+
+	return timeout;
+}
+
+static void isotp_check_jobs() {
+	int ch;
+	long long now = uds_now();
+
+	for (ch = 0; ch <= MAX_ISOTP_CHANNELS; ch++) {
+		if (channels[ch].job &&
+		    uds_check_timeout(channels[ch].job, now) == UDS_DONE)
+			isotp_job_done(ch);
+	}
+}
+
+static void isotp_receive_pdu(int ch) {
+	int i, items, len, chunk, ret;
+	struct timeval tv = {0};
+	char rxmsg[2 * PDU_CHUNK + 64]; /* can to inet */
+
+	/* the non-blocking read fails with EAGAIN on spurious wakeups */
+	items = read(channels[ch].socket, isobuf, ISOTP_MAXPDU);
+	if (items <= 0 || items > ISOTP_MAXPDU)
+		return;
+
+	conn_stats->can_rx++;
+	TRACE3(can_rx, STATE_ISOTP, ch, items);
+
+	/* responses of a running UDS job are not forwarded */
+	if (channels[ch].job) {
+		ret = uds_response(channels[ch].job, isobuf, items);
+		if (ret == UDS_DONE)
+			isotp_job_done(ch);
+		if (ret != UDS_NOT_MINE)
+			return;
+	}
+
+	/* read timestamp data */
+	if(ioctl(channels[ch].socket, SIOCGSTAMP, &tv) < 0) {
+		PRINT_ERROR("Could not receive timestamp\n");
+	}
+
+	if (ch == UNTAGGED_CHANNEL)
+		len = sprintf(rxmsg, "< pdu %ld.%06ld ", tv.tv_sec, tv.tv_usec);
+	else
+		len = sprintf(rxmsg, "< chpdu %d %ld.%06ld ", ch, tv.tv_sec, tv.tv_usec);
+
+	if (pdu_format == PDU_FORMAT_BINARY) {
+		/* the raw PDU data directly follows the element */
+		len += sprintf(rxmsg + len, "%d >", items);
+		client_send(rxmsg, len, MSG_MORE);
+		client_send(isobuf, items, 0);
+		latency_rx(&tv);
+		return;
+	}
+
+	/* encode and send the PDU in chunks behind the element start */
+	for (i = 0; i < items; i += chunk) {
+		chunk = (items - i > PDU_CHUNK) ? PDU_CHUNK : items - i;
+
+		if (pdu_format == PDU_FORMAT_BASE64)
+			len += base64_encode(rxmsg + len, isobuf + i, chunk);
+		else
+			len += hex_encode(rxmsg + len, isobuf + i, chunk);
+
+		if (i + chunk < items) {
+			client_send(rxmsg, len, MSG_MORE);
+			len = 0;
+		}
+	}
+
+	strcpy(rxmsg + len, " >");
+	client_send(rxmsg, len + 2, 0);
+	latency_rx(&tv);
+}
+
+/*
+ * Takes the PDU data from the given element of the command. In binary format
+ * the element holds the PDU length and the raw data follows the command.
+ * Returns the PDU length or -1 when there is no valid PDU.
+ */
+static int isotp_get_pdu(char *buf, int element, unsigned char *isobuf) {
+	int len;
+	char *data = element_start(buf, element);
+	int datalen = element_length(buf, element);
+
+	if (data == NULL) {
+		PRINT_ERROR("missing PDU data\n");
+		return -1;
+	}
+
+	switch (pdu_format) {
+	case PDU_FORMAT_BINARY:
+		if (sscanf(data, "%d", &len) != 1 || len < 0 || len > ISOTP_MAXPDU) {
+			/* we can not find the start of the next command anymore */
+			PRINT_ERROR("invalid binary PDU length\n");
+			state = STATE_SHUTDOWN;
+			return -1;
+		}
+
+		if (receive_data(client_socket, (char *) isobuf, len) < 0) {
+			state = STATE_SHUTDOWN;
+			return -1;
+		}
+		break;
+
+	case PDU_FORMAT_BASE64:
+		len = base64_decode(isobuf, data, datalen);
+		if (len < 0) {
+			PRINT_ERROR("invalid base64 PDU data\n");
+			return -1;
+		}
+		break;
+
+	default:
+		if (datalen & 1) {
+			PRINT_ERROR("odd number of ASCII Hex values\n");
+			return -1;
+		}
+
+		len = hex_decode(isobuf, data, datalen);
+		break;
+	}
+
+	return len;
+}
+
+/* only wait for the end of a transfer while a PDU is in flight */
+static void isotp_update_events(int ch) {
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	if (channels[ch].busy)
+		event.events |= EPOLLOUT;
+	event.data.u32 = ch;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, channels[ch].socket, &event);
+}
+
+static void isotp_send_error(int ch, int err) {
+	char buf[128];
+
+	if (ch == UNTAGGED_CHANNEL)
+		sprintf(buf, "< error write failed %s >", strerror(err));
+	else
+		sprintf(buf, "< error write on channel %d failed %s >", ch, strerror(err));
+	client_send(buf, strlen(buf), 0);
+}
+
+/*
+ * Hands the PDU to the kernel or queues it when a transfer is in progress.
+ * Returns -1 when the PDU could neither be written nor queued. While a UDS
+ * job runs on the channel all PDUs are requests of the job.
+ */
+int isotp_send_pdu(int ch, unsigned char *isobuf, int len) {
+	int ret;
+	int owner = (channels[ch].job) ? TX_JOB : TX_CLIENT;
+	struct isotp_pdu *pdu;
+
+	if (!channels[ch].busy) {
+		ret = write(channels[ch].socket, isobuf, len);
+		if (ret == len) {
+			conn_stats->can_tx++;
+			TRACE3(can_tx, STATE_ISOTP, ch, len);
+			if (owner == TX_CLIENT)
+				latency_tx();
+			channels[ch].busy = owner;
+			isotp_update_events(ch);
+			return 0;
+		}
+
+		if (ret >= 0 || errno != EAGAIN) {
+			int err = (ret < 0) ? errno : EMSGSIZE;
+
+			PRINT_ERROR("Error in write() %s\n", strerror(err))
+			conn_stats->can_tx_errors++;
+			errno = err;
+			return -1;
+		}
+
+		/* the kernel is still busy with a transfer we did not see finishing */
+		channels[ch].busy = TX_CLIENT;
+		isotp_update_events(ch);
+	}
+
+	if (channels[ch].queued >= ISOTP_MAXQUEUE) {
+		PRINT_ERROR("ISO-TP transmit queue of channel %d is full\n", ch)
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	pdu = malloc(sizeof(*pdu) + len);
+	if (pdu == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pdu->next = NULL;
+	pdu->owner = owner;
+	pdu->len = len;
+	memcpy(pdu->data, isobuf, len);
+
+	if (channels[ch].queue_tail)
+		channels[ch].queue_tail->next = pdu;
+	else
+		channels[ch].queue_head = pdu;
+	channels[ch].queue_tail = pdu;
+	channels[ch].queued++;
+
+	return 0;
+}
+
+/* the socket is writable again - the current transfer has finished */
+static void isotp_send_done(int ch) {
+	int ret;
+	char buf[32];
+	struct isotp_pdu *pdu;
+
+	if (channels[ch].busy == TX_CLIENT) {
+		if (ch == UNTAGGED_CHANNEL)
+			strcpy(buf, "< pdusent >");
+		else
+			sprintf(buf, "< chpdusent %d >", ch);
+		client_send(buf, strlen(buf), 0);
+	}
+	channels[ch].busy = 0;
+
+	while (!channels[ch].busy && (pdu = channels[ch].queue_head) != NULL) {
+		ret = write(channels[ch].socket, pdu->data, pdu->len);
+		if (ret < 0 && errno == EAGAIN) {
+			channels[ch].busy = TX_CLIENT;
+			break;
+		}
+
+		channels[ch].queue_head = pdu->next;
+		if (channels[ch].queue_head == NULL)
+			channels[ch].queue_tail = NULL;
+		channels[ch].queued--;
+
+		if (ret == pdu->len) {
+			conn_stats->can_tx++;
+			TRACE3(can_tx, STATE_ISOTP, ch, pdu->len);
+			channels[ch].busy = pdu->owner;
+		} else {
+			conn_stats->can_tx_errors++;
+			isotp_send_error(ch, (ret < 0) ? errno : EMSGSIZE);
+		}
+
+		free(pdu);
+	}
+
+	/* the request of the job is out - wait for the response */
+	if (!channels[ch].busy && channels[ch].job)
+		uds_sent(channels[ch].job);
+
+	isotp_update_events(ch);
+}
+
+/* asynchronous errors, e.g. a missing flow control from the ECU */
+static void isotp_socket_error(int ch) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(channels[ch].socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || !err)
+		return;
+
+	PRINT_ERROR("Error on ISO-TP channel %d %s\n", ch, strerror(err));
+	conn_stats->can_tx_errors++;
+	isotp_send_error(ch, err);
+}
+
+/* returns the channel handle of a '< cmd ch ... >' command or -1 */
+static int isotp_get_channel(char *buf) {
+	int ch;
+
+	if (sscanf(buf, "< %*s %d ", &ch) != 1 || ch < 0 || ch >= MAX_ISOTP_CHANNELS) {
+		PRINT_ERROR("invalid ISO-TP channel in '%s'\n", buf);
+		return -1;
+	}
+	return ch;
+}
+
+static void isotp_command(char *buf) {
+	int ch, len;
 	struct sockaddr_can addr;
-	struct ifreq ifr;
 	static struct can_isotp_options opts;
 	static struct can_isotp_fc_options fcopts;
+	static struct can_isotp_ll_options llopts;
 
-	char rxmsg[MAXLEN]; /* can to inet */
-	char buf[MAXLEN]; /* inet commands to can */
-	unsigned char isobuf[ISOTPLEN+1]; /* binary buffer for isotp socket */
-	unsigned char tmp;
-	
-	while(previous_state != STATE_ISOTP) {
+	if (state_changed(buf, state)) {
+		isotp_close_all();
+		strcpy(buf, "< ok >");
+		client_send(buf, strlen(buf), 0);
+		return;
+	}
 
-		ret = receive_command(client_socket, buf);
-		if(ret != 0) {
-			state = STATE_SHUTDOWN;
+	if(!strcmp("< echo >", buf)) {
+		client_send(buf, strlen(buf), 0);
+		return;
+	}
+
+	/* get configuration to open the untagged channel */
+	if(!strncmp("< isotpconf ", buf, 12)) {
+		if (isotp_parse_conf(buf, 2, &addr, &opts, &fcopts, &llopts) < 0) {
+			conn_stats->parse_errors++;
+			PRINT_ERROR("Syntax error in isotpconf command\n");
 			return;
 		}
 
-		strncpy(ifr.ifr_name, bus_name, IFNAMSIZ);
+		if (isotp_open_channel(UNTAGGED_CHANNEL, &addr, &opts, &fcopts, &llopts) < 0)
+			state = STATE_SHUTDOWN;
+
+	} else if(!strncmp("< isotpopen ", buf, 12)) {
+		if ((ch = isotp_get_channel(buf)) < 0)
+			return;
 
-		if (state_changed(buf, state)) {
-			/* ensure proper handling in other states */
-			previous_state = STATE_ISOTP;
-			strcpy(buf, "< ok >");
-			send(client_socket, buf, strlen(buf), 0);
+		if (isotp_parse_conf(buf, 3, &addr, &opts, &fcopts, &llopts) < 0) {
+			conn_stats->parse_errors++;
+			PRINT_ERROR("Syntax error in isotpopen command\n");
+			strcpy(buf, "< error syntax error in isotpopen >");
+			client_send(buf, strlen(buf), 0);
 			return;
 		}
 
-		if(!strcmp("< echo >", buf)) {
-			send(client_socket, buf, strlen(buf), 0);
-			continue;
+		if (isotp_open_channel(ch, &addr, &opts, &fcopts, &llopts) < 0) {
+			sprintf(buf, "< error could not open channel %d >", ch);
+			client_send(buf, strlen(buf), 0);
 		}
 
-		memset(&opts, 0, sizeof(opts));
-		memset(&fcopts, 0, sizeof(fcopts));
-		memset(&addr, 0, sizeof(addr));
-
-		/* get configuration to open the socket */
-		if(!strncmp("< isotpconf ", buf, 12)) {
-			items = sscanf(buf, "< %*s %x %x %x "
-				       "%hhu %hhx %hhu "
-				       "%hhx %hhx %hhx %hhx >",
-				       &addr.can_addr.tp.tx_id,
-				       &addr.can_addr.tp.rx_id,
-				       &opts.flags,
-				       &fcopts.bs,
-				       &fcopts.stmin,
-				       &fcopts.wftmax,
-				       &opts.txpad_content,
-				       &opts.rxpad_content,
-				       &opts.ext_address,
-				       &opts.rx_ext_address);
-
-			/* < isotpconf XXXXXXXX ... > check for extended identifier */
-			if(element_length(buf, 2) == 8)
-				addr.can_addr.tp.tx_id |= CAN_EFF_FLAG;
-
-			if(element_length(buf, 3) == 8)
-				addr.can_addr.tp.rx_id |= CAN_EFF_FLAG;
-
-			if ((opts.flags & CAN_ISOTP_RX_EXT_ADDR && items < 10) ||
-			    (opts.flags & CAN_ISOTP_EXTEND_ADDR && items < 9) ||
-			    (opts.flags & CAN_ISOTP_RX_PADDING && items < 8) ||
-			    (opts.flags & CAN_ISOTP_TX_PADDING && items < 7) ||
-			    (items < 5)) {
-				PRINT_ERROR("Syntax error in isotpconf command\n");
-				/* try it once more */
-				continue;
-			}
+	} else if(!strncmp("< isotpclose ", buf, 13)) {
+		if ((ch = isotp_get_channel(buf)) >= 0)
+			isotp_close_channel(ch);
 
-			/* open ISOTP socket */
-			if ((si = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP)) < 0) {
-				PRINT_ERROR("Error while opening ISOTP socket %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
-			}
+	} else if(!strncmp("< isotpbus ", buf, 11)) {
+		char name[MAX_BUSNAME];
+		int i, found = 0;
 
-			strcpy(ifr.ifr_name, bus_name);
-			if(ioctl(si, SIOCGIFINDEX, &ifr) < 0) {
-				PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
+		/* check if access to this bus is allowed */
+		if (sscanf(buf, "< isotpbus %16s >", name) == 1) {
+			for (i = 0; i < interface_count; i++) {
+				if (!strcmp(interface_names[i], name))
+					found = 1;
 			}
+		}
 
-			addr.can_family = PF_CAN;
-			addr.can_ifindex = ifr.ifr_ifindex;
+		if (!found) {
+			PRINT_INFO("client tried to access unauthorized bus.\n");
+			strcpy(buf, "< error could not open bus >");
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
 
-			/* only change the built-in defaults when required */
-			if (opts.flags)
-				setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts));
+		/* the timing of the new bus applies to the following channels */
+		strcpy(isotp_bus, name);
+		isotp_load_profile();
 
-			setsockopt(si, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fcopts, sizeof(fcopts));
+		strcpy(buf, "< ok >");
+		client_send(buf, strlen(buf), 0);
 
-			PRINT_VERBOSE("binding ISOTP socket...\n")
-			if (bind(si, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-				PRINT_ERROR("Error while binding ISOTP socket %s\n", strerror(errno));
-				/* ensure proper handling in other states */
-				previous_state = STATE_ISOTP;
-				state = STATE_SHUTDOWN;
-				return;
-			}
-			
-			/* ok we made it and have a proper isotp socket open */
-			previous_state = STATE_ISOTP;
+	} else if(!strncmp("< isotptiming ", buf, 14)) {
+		struct isotp_timing t;
+
+		if (sscanf(buf, "< isotptiming %u %u %u %x >", &t.frame_txtime,
+			   &t.tx_stmin, &t.rx_stmin, &t.flags) != 4) {
+			conn_stats->parse_errors++;
+			PRINT_ERROR("Syntax error in isotptiming command\n");
+			strcpy(buf, "< error syntax error in isotptiming >");
+			client_send(buf, strlen(buf), 0);
+			return;
 		}
-	} /* while */
 
-	FD_ZERO(&readfds);
-	FD_SET(si, &readfds);
-	FD_SET(client_socket, &readfds);
+		timing = t;
+		strcpy(buf, "< ok >");
+		client_send(buf, strlen(buf), 0);
+
+	} else if(!strncmp("< pduformat ", buf, 12)) {
+		if (!strcmp("< pduformat hex >", buf))
+			pdu_format = PDU_FORMAT_HEX;
+		else if (!strcmp("< pduformat base64 >", buf))
+			pdu_format = PDU_FORMAT_BASE64;
+		else if (!strcmp("< pduformat binary >", buf))
+			pdu_format = PDU_FORMAT_BINARY;
+		else {
+			conn_stats->parse_errors++;
+			PRINT_ERROR("Syntax error in pduformat command\n");
+			strcpy(buf, "< error unknown pduformat >");
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
 
-	/*
-	 * Check if there are more elements in the element buffer before calling select() and
-	 * blocking for new packets.
-	 */
-	if(more_elements) {
-		FD_CLR(si, &readfds);
-	} else {
-		ret = select((si > client_socket)?si+1:client_socket+1, &readfds, NULL, NULL, NULL);
-		if(ret < 0) {
-			PRINT_ERROR("Error in select()\n")
-				state = STATE_SHUTDOWN;
+		strcpy(buf, "< ok >");
+		client_send(buf, strlen(buf), 0);
+
+	} else if(!strncmp("< sendpdu ", buf, 10)) {
+		if ((len = isotp_get_pdu(buf, 2, isobuf)) < 0)
+			return;
+
+		if (channels[UNTAGGED_CHANNEL].socket < 0) {
+			PRINT_ERROR("no ISO-TP channel configured\n");
 			return;
 		}
-	}
 
-	if (FD_ISSET(si, &readfds)) {
+		if (channels[UNTAGGED_CHANNEL].job) {
+			strcpy(buf, "< error channel busy >");
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
+
+		/* a full queue is the client's business, a failing socket ends the connection */
+		if (isotp_send_pdu(UNTAGGED_CHANNEL, isobuf, len) < 0) {
+			if (errno == ENOBUFS || errno == ENOMEM)
+				isotp_send_error(UNTAGGED_CHANNEL, errno);
+			else
+				state = STATE_SHUTDOWN;
+		}
 
-		struct timeval tv = {0};
+	} else if(!strncmp("< chsendpdu ", buf, 12)) {
+		/* always take the PDU to keep a binary data stream in sync */
+		ch = isotp_get_channel(buf);
+		if ((len = isotp_get_pdu(buf, 3, isobuf)) < 0 || ch < 0)
+			return;
 
-		items = read(si, isobuf, ISOTPLEN);
+		if (channels[ch].socket < 0) {
+			sprintf(buf, "< error channel %d not open >", ch);
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
 
-		/* read timestamp data */
-		if(ioctl(si, SIOCGSTAMP, &tv) < 0) {
-			PRINT_ERROR("Could not receive timestamp\n");
+		if (channels[ch].job) {
+			sprintf(buf, "< error channel %d busy >", ch);
+			client_send(buf, strlen(buf), 0);
+			return;
 		}
 
-		if (items > 0 && items <= ISOTPLEN) {
+		/* a failing channel does not affect the other channels */
+		if (isotp_send_pdu(ch, isobuf, len) < 0)
+			isotp_send_error(ch, errno);
 
-			int startlen;
+	} else if(!strncmp("< udsbatch ", buf, 11) || !strncmp("< chudsbatch ", buf, 13) ||
+		  !strncmp("< flash ", buf, 8) || !strncmp("< chflash ", buf, 10)) {
+		int tagged = !strncmp("< ch", buf, 4);
+		int flash = !strncmp("flash ", buf + ((tagged) ? 4 : 2), 6);
 
-			sprintf(rxmsg, "< pdu %ld.%06ld ", tv.tv_sec, tv.tv_usec);
-			startlen = strlen(rxmsg);
+		ch = (tagged) ? isotp_get_channel(buf) : UNTAGGED_CHANNEL;
+		if (ch < 0 || channels[ch].socket < 0) {
+			strcpy(buf, "< error channel not open >");
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
 
-			for (i=0; i < items; i++)
-				sprintf(rxmsg + startlen + 2*i, "%02X", isobuf[i]);
+		/* the responses can only be correlated on an idle channel */
+		if (channels[ch].job || channels[ch].busy) {
+			strcpy(buf, "< error channel busy >");
+			client_send(buf, strlen(buf), 0);
+			return;
+		}
 
-			sprintf(rxmsg + strlen(rxmsg), " >");
-			send(client_socket, rxmsg, strlen(rxmsg), 0);
+		if (flash)
+			channels[ch].job = uds_flash_new(ch, buf, (tagged) ? 3 : 2);
+		else
+			channels[ch].job = uds_batch_new(ch, buf, (tagged) ? 3 : 2);
+
+		if (channels[ch].job == NULL) {
+			PRINT_ERROR("Error in UDS job command '%s'\n", buf);
+			strcpy(buf, (flash) ? "< error could not start flashing >" :
+			       "< error syntax error in udsbatch >");
+			client_send(buf, strlen(buf), 0);
+			return;
 		}
+
+		if (uds_start(channels[ch].job) == UDS_DONE)
+			isotp_job_done(ch);
+
+	} else {
+		conn_stats->parse_errors++;
+		PRINT_ERROR("unknown command '%s'.\n", buf)
+			strcpy(buf, "< error unknown command >");
+		client_send(buf, strlen(buf), 0);
 	}
+}
 
-	if (FD_ISSET(client_socket, &readfds)) {
+/* releases the channels when the connection has ended */
+void state_isotp_close() {
+	if (epoll_fd >= 0 || isobuf)
+		isotp_close_all();
+}
 
-		ret = receive_command(client_socket, buf);
-		if(ret != 0) {
+void state_isotp() {
+	int i, n, ret;
+	char buf[MAXLEN]; /* inet commands to can */
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event event;
+
+	if(previous_state != STATE_ISOTP) {
+
+		memset(channels, 0, sizeof(channels));
+		for (i = 0; i <= MAX_ISOTP_CHANNELS; i++)
+			channels[i].socket = -1;
+
+		pdu_format = PDU_FORMAT_HEX;
+		strcpy(isotp_bus, bus_name);
+		isotp_load_profile();
+
+		if ((isobuf = malloc(ISOTP_MAXPDU)) == NULL) {
+			PRINT_ERROR("Could not allocate ISOTP buffer\n");
 			state = STATE_SHUTDOWN;
 			return;
 		}
 
-		if (state_changed(buf, state)) {
-			close(si);
-			strcpy(buf, "< ok >");
-			send(client_socket, buf, strlen(buf), 0);
+		if ((epoll_fd = epoll_create1(0)) < 0) {
+			PRINT_ERROR("Error in epoll_create1() %s\n", strerror(errno));
+			state = STATE_SHUTDOWN;
 			return;
 		}
 
-		if(!strcmp("< echo >", buf)) {
-			send(client_socket, buf, strlen(buf), 0);
+		event.events = EPOLLIN;
+		event.data.u32 = CLIENT_EVENT;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+			PRINT_ERROR("Error in epoll_ctl() %s\n", strerror(errno));
+			state = STATE_SHUTDOWN;
 			return;
 		}
 
-		if(!strncmp("< sendpdu ", buf, 10)) {
-			items = element_length(buf, 2);
-			if (items & 1) {
-				PRINT_ERROR("odd number of ASCII Hex values\n");
-				return;
-			}
+		previous_state = STATE_ISOTP;
+	}
 
-			items /= 2;
-			if (items > ISOTPLEN) {
-				PRINT_ERROR("PDU too long\n");
+	/*
+	 * Check if there are more elements in the element buffer before calling epoll_wait() and
+	 * blocking for new packets.
+	 */
+	if(more_elements) {
+		n = 1;
+		events[0].data.u32 = CLIENT_EVENT;
+	} else {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, isotp_job_timeout());
+		if(n < 0) {
+			if (errno == EINTR)
 				return;
-			}
+			PRINT_ERROR("Error in epoll_wait()\n")
+				state = STATE_SHUTDOWN;
+			return;
+		}
+	}
 
-			for (i = 0; i < items; i++) {
+	for (i = 0; i < n; i++) {
 
-				tmp = asc2nibble(buf[(2*i) + 10]);
-				if (tmp > 0x0F)
-					return;
-				isobuf[i] = (tmp << 4);
-				tmp = asc2nibble(buf[(2*i) + 11]);
-				if (tmp > 0x0F)
-					return;
-				isobuf[i] |= tmp;
-			}
+		if (events[i].data.u32 != CLIENT_EVENT) {
+			int ch = events[i].data.u32;
 
-			ret = write(si, isobuf, items);
-			if(ret != items) {
-				PRINT_ERROR("Error in write()\n")
-					state = STATE_SHUTDOWN;
-				return;
-			}
-		} else {
-			PRINT_ERROR("unknown command '%s'.\n", buf)
-				strcpy(buf, "< error unknown command >");
-			send(client_socket, buf, strlen(buf), 0);
+			/* the channel might have been closed by a previous command */
+			if (channels[ch].socket < 0)
+				continue;
+
+			if (events[i].events & EPOLLERR)
+				isotp_socket_error(ch);
+
+			if (events[i].events & EPOLLIN)
+				isotp_receive_pdu(ch);
+
+			if (events[i].events & EPOLLOUT)
+				isotp_send_done(ch);
+			continue;
+		}
+
+		ret = receive_command(client_socket, buf);
+		if(ret != 0) {
+			isotp_close_all();
+			state = STATE_SHUTDOWN;
+			return;
 		}
+
+		isotp_command(buf);
+
+		/* the channels are gone after a mode switch */
+		if (state != STATE_ISOTP)
+			return;
 	}
+
+	isotp_check_jobs();
 }
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "socketcand.h"
 #include "statistics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,8 +21,7 @@
 
 #include <linux/can.h>
 
-int raw_socket;
-struct ifreq ifr;
+int raw_socket = -1;
 struct sockaddr_can addr;
 fd_set readfds;
 struct msghdr msg;
@@ -30,6 +30,14 @@ struct iovec iov;
 char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
 struct timeval tv;
 struct cmsghdr *cmsg;
+static __u32 raw_drops; /* last SO_RXQ_OVFL count of the current RAW socket */
+
+/* releases the RAW socket when the connection has ended */
+void state_raw_close() {
+	if(raw_socket >= 0)
+		close(raw_socket);
+	raw_socket = -1;
+}
 
 void state_raw() {
 	char buf[MAXLEN];
@@ -43,15 +51,13 @@ void state_raw() {
 			return;
 		}
 
-		strcpy(ifr.ifr_name, bus_name);
-		if(ioctl(raw_socket, SIOCGIFINDEX, &ifr) < 0) {
+		if((addr.can_ifindex = bus_ifindex(bus_name)) == 0) {
 			PRINT_ERROR("Error while searching for bus %s\n", strerror(errno));
 			state = STATE_SHUTDOWN;
 			return;
 		}
 
 		addr.can_family = AF_CAN;
-		addr.can_ifindex = ifr.ifr_ifindex;
 
 		const int timestamp_on = 1;
 		if(setsockopt( raw_socket, SOL_SOCKET, SO_TIMESTAMP, &timestamp_on, sizeof(timestamp_on)) < 0) {
@@ -60,8 +66,14 @@ void state_raw() {
 			return;
 		}
 
+		/* the kernel reports the number of dropped frames with each frame */
+		setsockopt(raw_socket, SOL_SOCKET, SO_RXQ_OVFL, &timestamp_on, sizeof(timestamp_on));
+		raw_drops = 0;
+
 		if(bind(raw_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 			PRINT_ERROR("Error while binding RAW socket %s\n", strerror(errno));
+			if(errno == ENODEV)
+				bus_ifindex_flush();
 			state = STATE_SHUTDOWN;
 			return;
 		}
@@ -105,19 +117,28 @@ void state_raw() {
 		if(ret < sizeof(struct can_frame)) {
 			PRINT_ERROR("Error reading frame from RAW socket\n")
 				} else {
+			conn_stats->can_rx++;
+			TRACE3(can_rx, STATE_RAW, frame.can_id, frame.can_dlc);
+
 			/* read timestamp data */
 			for (cmsg = CMSG_FIRSTHDR(&msg);
 			     cmsg && (cmsg->cmsg_level == SOL_SOCKET);
 			     cmsg = CMSG_NXTHDR(&msg,cmsg)) {
 				if (cmsg->cmsg_type == SO_TIMESTAMP) {
 					tv = *(struct timeval *)CMSG_DATA(cmsg);
+				} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+					/* the count of the socket starts at 0 with every rawmode */
+					__u32 drops = *(__u32 *)CMSG_DATA(cmsg);
+
+					conn_stats->can_drops += drops - raw_drops;
+					raw_drops = drops;
 				}
 			}
 
 			if(frame.can_id & CAN_ERR_FLAG) {
 				canid_t class = frame.can_id  & CAN_EFF_MASK;
 				ret = sprintf(buf, "< error %03X %ld.%06ld >", class, tv.tv_sec, tv.tv_usec);
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 			} else if(frame.can_id & CAN_RTR_FLAG) {
 				/* TODO implement */
 			} else {
@@ -130,7 +151,8 @@ void state_raw() {
 					ret += sprintf(buf+ret, "%02X", frame.data[i]);
 				}
 				sprintf(buf+ret, " >");
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
+				latency_rx(&tv);
 			}
 		}
 	}
@@ -142,13 +164,14 @@ void state_raw() {
 
 			if (state_changed(buf, state)) {
 				close(raw_socket);
+				raw_socket = -1;
 				strcpy(buf, "< ok >");
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 				return;
 			}
 
 			if(!strcmp("< echo >", buf)) {
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 				return;
 			}
 
@@ -171,6 +194,7 @@ void state_raw() {
 				if ( (items < 2) ||
 				     (frame.can_dlc > 8) ||
 				     (items != 2 + frame.can_dlc)) {
+					conn_stats->parse_errors++;
 					PRINT_ERROR("Syntax error in send command\n")
 						return;
 				}
@@ -181,14 +205,19 @@ void state_raw() {
 
 				ret = send(raw_socket, &frame, sizeof(struct can_frame), 0);
 				if(ret==-1) {
+					conn_stats->can_tx_errors++;
 					state = STATE_SHUTDOWN;
 					return;
 				}
+				conn_stats->can_tx++;
+				TRACE3(can_tx, STATE_RAW, frame.can_id, frame.can_dlc);
+				latency_tx();
 
 			} else {
+				conn_stats->parse_errors++;
 				PRINT_ERROR("unknown command '%s'\n", buf);
 				strcpy(buf, "< error unknown command >");
-				send(client_socket, buf, strlen(buf), 0);
+				client_send(buf, strlen(buf), 0);
 			}
 		} else {
 			state = STATE_SHUTDOWN;
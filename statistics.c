@@ -3,135 +3,661 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <stdio.h>
-#include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/can/netlink.h>
 
 #include "socketcand.h"
+#include "metrics.h"
 
 int statistics_ival = 0;
 
-struct timeval last_fired;
+static int nl = -1; /* rtnetlink socket */
 
-void *statistics_loop(void *ptr) {
-	int items, found;
-	struct timeval current_time;
-	int elapsed;
-	char buffer[STAT_BUF_LEN];
-	/*int state;
-	  struct can_berr_counter errorcnt;*/
-	FILE *proc_net_dev;
-	struct proc_stat_entry proc_entry;
-	char line[PROC_LINESIZE];
+/* rtnetlink socket to query the interface statistics */
+int statistics_open() {
+	int nl;
+	struct sockaddr_nl addr;
 
-	gettimeofday(&last_fired, 0);
+	if((nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		PRINT_ERROR("Error while opening netlink socket %s\n", strerror(errno));
+		return -1;
+	}
 
-	while(1) {
-		/* check if statistics are enabled */
-		if( statistics_ival == 0 ) {
-			sleep(1);
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if(bind(nl, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding netlink socket %s\n", strerror(errno));
+		close(nl);
+		return -1;
+	}
+
+	return nl;
+}
+
+/* bitrates and controller state from the CAN specific data of IFLA_LINKINFO */
+static void parse_linkinfo(struct rtattr *linkinfo, struct can_link_info *info) {
+	struct rtattr *rta, *can;
+	int len = RTA_PAYLOAD(linkinfo), canlen;
+
+	for(rta = RTA_DATA(linkinfo); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if(rta->rta_type != IFLA_INFO_DATA)
 			continue;
+
+		canlen = RTA_PAYLOAD(rta);
+		for(can = RTA_DATA(rta); RTA_OK(can, canlen); can = RTA_NEXT(can, canlen)) {
+			if(RTA_PAYLOAD(can) < sizeof(__u32))
+				continue;
+
+			/* the bitrate is the first member of struct can_bittiming */
+			if(can->rta_type == IFLA_CAN_BITTIMING)
+				info->bitrate = *(__u32 *) RTA_DATA(can);
+			else if(can->rta_type == IFLA_CAN_DATA_BITTIMING)
+				info->data_bitrate = *(__u32 *) RTA_DATA(can);
+			else if(can->rta_type == IFLA_CAN_STATE)
+				info->state = *(__u32 *) RTA_DATA(can);
+			else if(can->rta_type == IFLA_CAN_BERR_COUNTER) {
+				info->txerr = ((struct can_berr_counter *) RTA_DATA(can))->txerr;
+				info->rxerr = ((struct can_berr_counter *) RTA_DATA(can))->rxerr;
+			}
 		}
+	}
+}
 
-		/* read /proc/net/dev */
-		proc_net_dev = fopen( "/proc/net/dev", "r" );
-		if( proc_net_dev == NULL ) {
-			PRINT_ERROR("could not open /proc/net/dev");
-			sleep(1);
-			continue;
+/*
+ * Takes the 64 bit counters (IFLA_STATS64) and the CAN link information
+ * (info may be NULL) from a RTM_NEWLINK message.
+ */
+static int parse_link(struct nlmsghdr *nh, struct rtnl_link_stats64 *stats, struct can_link_info *info) {
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int attrlen = IFLA_PAYLOAD(nh), found = 0;
+
+	if(info) {
+		memset(info, 0, sizeof(*info));
+		info->state = -1;
+		info->up = !!(ifi->ifi_flags & IFF_UP);
+	}
+
+	for(rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+		if(rta->rta_type == IFLA_STATS64) {
+			/* older kernels provide less counters */
+			memset(stats, 0, sizeof(*stats));
+			memcpy(stats, RTA_DATA(rta), (RTA_PAYLOAD(rta) < sizeof(*stats)) ?
+			       RTA_PAYLOAD(rta) : sizeof(*stats));
+			found = 1;
+		} else if(rta->rta_type == IFLA_LINKINFO && info) {
+			parse_linkinfo(rta, info);
 		}
+	}
+
+	return found ? 0 : -1;
+}
+
+/*
+ * Fetches the counters and optionally the bitrates of a single interface
+ * with RTM_GETLINK.
+ */
+int statistics_read(int nl, int ifindex, struct rtnl_link_stats64 *stats, struct can_link_info *info) {
+	static __u32 seq;
+	static char *buf;
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+	struct nlmsghdr *nh;
+	int len;
+
+	if(buf == NULL && (buf = malloc(NETLINK_BUF_LEN)) == NULL)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = ++seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
 
-		found=0;
-		while(1) {
-			if(fgets( line , PROC_LINESIZE, proc_net_dev ) == NULL)
-				break;
+	if(send(nl, &req, req.nh.nlmsg_len, 0) < 0)
+		return -1;
 
-			/* extract name */
-			char* s = (char *) &line;
-			char* name = strsep(&s, ":");
-			if(s == NULL) { /* no : in line */
+	while(1) {
+		len = recv(nl, buf, NETLINK_BUF_LEN, 0);
+		if(len < 0) {
+			if(errno == EINTR)
 				continue;
-			}
+			return -1;
+		}
+
+		for(nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			/* skip answers to older requests */
+			if(nh->nlmsg_seq != seq)
+				continue;
+
+			if(nh->nlmsg_type == NLMSG_ERROR || nh->nlmsg_type == NLMSG_DONE)
+				return -1;
+
+			if(nh->nlmsg_type != RTM_NEWLINK)
+				continue;
+
+			return parse_link(nh, stats, info);
+		}
+	}
+}
+
+/*
+ * The statistics are driven by a timerfd in the event loop of the control
+ * mode. The counters are only fetched when the timer expires, a disabled
+ * interval (0) disarms the timer.
+ */
+int statistics_timer_open() {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+	if(fd < 0)
+		PRINT_ERROR("Error while creating statistics timer %s\n", strerror(errno));
+
+	return fd;
+}
+
+void statistics_timer_set(int fd, int ival) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = ival / 1000;
+	its.it_interval.tv_nsec = (ival % 1000) * 1000000;
+	its.it_value = its.it_interval;
+
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+void statistics_timer_close(int fd) {
+	close(fd);
+
+	if(nl >= 0)
+		close(nl);
+	nl = -1;
+}
+
+/* consumes the expirations of the timer - returns 0 if it has not expired */
+int statistics_timer_expired(int fd) {
+	__u64 expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	return 1;
+}
+
+void statistics_fire(int fd) {
+	char buffer[STAT_BUF_LEN];
+	struct rtnl_link_stats64 stats;
+	struct busload load;
+	int ifindex, have_load = 1;
+
+	if(!statistics_timer_expired(fd))
+		return;
+
+	/* prefer the counters published by the collector of the parent */
+	if(statistics_snapshot(statistics_bus_index(bus_name), &stats, &load, 2 * statistics_ival) < 0) {
+		have_load = 0;
+
+		if(nl < 0 && (nl = statistics_open()) < 0)
+			return;
+
+		/* If we can not read the device there is something wrong. */
+		ifindex = if_nametoindex(bus_name);
+		if(!ifindex || statistics_read(nl, ifindex, &stats, NULL) < 0) {
+			PRINT_ERROR("could not read statistics of device %s\n", bus_name);
+			return;
+		}
+	}
+
+	snprintf( buffer, STAT_BUF_LEN, "< stat %llu %llu %llu %llu >",
+		  (unsigned long long) stats.rx_bytes,
+		  (unsigned long long) stats.rx_packets,
+		  (unsigned long long) stats.tx_bytes,
+		  (unsigned long long) stats.tx_packets);
+
+	client_send(buffer, strlen(buffer), 0 );
+
+	/* the bus load is only known by the collector */
+	if(have_load) {
+		busload_format(buffer, &load);
+		client_send(buffer, strlen(buffer), 0 );
+	}
+}
+
+/* '< busload load1 load10 fps1 fps10 >' - the load is '-' without bitrate */
+void busload_format(char *buffer, struct busload *load) {
+	char load1[16], load10[16];
+
+	if(load->load1 < 0)
+		strcpy(load1, "-");
+	else
+		snprintf(load1, sizeof(load1), "%.2f", load->load1);
+
+	if(load->load10 < 0)
+		strcpy(load10, "-");
+	else
+		snprintf(load10, sizeof(load10), "%.2f", load->load10);
+
+	snprintf(buffer, STAT_BUF_LEN, "< busload %s %s %.1f %.1f >",
+		 load1, load10, load->fps1, load->fps10);
+}
+
+/*
+ * CAN controller state
+ *
+ * In control mode the connection subscribes to the rtnetlink link
+ * notifications (RTMGRP_LINK) and reports the state and the error counters
+ * of its bus with '< canstate STATE txerr rxerr >' whenever they change.
+ * Not every driver notifies about state changes, so the state is also
+ * requested on the same socket with every statistics interval. Interfaces
+ * without a CAN controller (vcan) report ERROR_ACTIVE while they are up.
+ */
+static const char *can_state_names[] = {
+	"ERROR_ACTIVE", "ERROR_WARNING", "ERROR_PASSIVE", "BUS_OFF", "STOPPED", "SLEEPING"
+};
+
+static int canstate_last = -1;
+static int canstate_txerr, canstate_rxerr;
+
+int canstate_open() {
+	int fd;
+	struct sockaddr_nl addr;
+
+	if((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE)) < 0) {
+		PRINT_ERROR("Error while opening netlink socket %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+
+	if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		PRINT_ERROR("Error while binding netlink socket %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	canstate_last = -1;
+	return fd;
+}
+
+/* asks for the link of the bus - the answer is handled by canstate_receive() */
+void canstate_request(int fd) {
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = if_nametoindex(bus_name);
+
+	if(req.ifi.ifi_index)
+		send(fd, &req, req.nh.nlmsg_len, 0);
+}
+
+static void canstate_update(struct can_link_info *info) {
+	char buffer[STAT_BUF_LEN];
+	int state = info->state;
+
+	/* no controller state - e.g. vcan */
+	if(state < 0 || state >= CAN_STATE_MAX)
+		state = info->up ? CAN_STATE_ERROR_ACTIVE : CAN_STATE_STOPPED;
+
+	if(state == canstate_last && info->txerr == canstate_txerr && info->rxerr == canstate_rxerr)
+		return;
+
+	canstate_last = state;
+	canstate_txerr = info->txerr;
+	canstate_rxerr = info->rxerr;
+
+	snprintf(buffer, STAT_BUF_LEN, "< canstate %s %u %u >",
+		 can_state_names[state], info->txerr, info->rxerr);
+	client_send(buffer, strlen(buffer), 0);
+}
 
-			/* remove heading whitespace */
-			int pos = 0;
-			for(;pos<strlen(name);pos++)
-				if(name[pos] != ' ')
-					break;
-			name += pos;
+/* handles the pending notifications and answers */
+void canstate_receive(int fd) {
+	static char *buf;
+	struct nlmsghdr *nh;
+	struct rtnl_link_stats64 stats;
+	struct can_link_info info;
+	int len, ifindex = if_nametoindex(bus_name);
 
-			/* do we care for this device? */
-			if(strcmp(bus_name, name))
+	if(buf == NULL && (buf = malloc(NETLINK_BUF_LEN)) == NULL)
+		return;
+
+	while((len = recv(fd, buf, NETLINK_BUF_LEN, MSG_DONTWAIT)) != 0) {
+		if(len < 0) {
+			/* notifications have been lost - ask again */
+			if(errno == ENOBUFS)
+				canstate_request(fd);
+			if(errno == EINTR || errno == ENOBUFS)
+				continue;
+			return;
+		}
+
+		for(nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if(nh->nlmsg_type != RTM_NEWLINK ||
+			   ((struct ifinfomsg *) NLMSG_DATA(nh))->ifi_index != ifindex)
 				continue;
 
-			items = sscanf( s, " %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u",
-					&proc_entry.rbytes,
-					&proc_entry.rpackets,
-					&proc_entry.rerrs,
-					&proc_entry.rdrop,
-					&proc_entry.rfifo,
-					&proc_entry.rframe,
-					&proc_entry.rcompressed,
-					&proc_entry.rmulticast,
-					&proc_entry.tbytes,
-					&proc_entry.tpackets,
-					&proc_entry.terrs,
-					&proc_entry.tdrop,
-					&proc_entry.tfifo,
-					&proc_entry.tcolls,
-					&proc_entry.tcarrier,
-					&proc_entry.tcompressed );
-
-			if( items == 16 ) {
-				found=1;
-				break;
+			parse_link(nh, &stats, &info);
+			canstate_update(&info);
+		}
+	}
+}
+
+/* reports the counters of this connection */
+void connstats_send() {
+	char buffer[STAT_BUF_LEN];
+
+	snprintf( buffer, STAT_BUF_LEN, "< connstats %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu >",
+		  conn_stats->client_rx_bytes,
+		  conn_stats->client_tx_bytes,
+		  conn_stats->can_rx,
+		  conn_stats->can_tx,
+		  conn_stats->commands,
+		  conn_stats->parse_errors,
+		  conn_stats->can_tx_errors,
+		  conn_stats->can_drops,
+		  conn_stats->outq_max,
+		  conn_stats->send_blocked_ns / 1000);
+
+	client_send( buffer, strlen(buffer), 0 );
+}
+
+/*
+ * Statistics collector
+ *
+ * The parent reads the counters of all busses with a single netlink socket
+ * and publishes them in a shared mapping, so the connection processes in
+ * control mode do not query the kernel each on their own. Every entry is
+ * protected by a seqlock: the collector makes the sequence odd while it
+ * updates the entry, a reader retries until it has copied the entry with an
+ * even and unchanged sequence. The readers never block the collector.
+ *
+ * The collector runs with the shortest interval requested by a connection
+ * (and at least every COLLECT_METRICS_IVAL while the metrics listener is
+ * enabled). A connection that changes its interval wakes the collector with
+ * statistics_collector_wake(), so it blocks while nobody is interested.
+ * While it runs it also receives all frames of the busses to estimate the
+ * bus load (see busload.c) and publishes the load every BUSLOAD_SLOT_MS.
+ */
+struct bus_snapshot {
+	unsigned int seq;
+	int valid;
+	long long stamp; /* ms, CLOCK_MONOTONIC */
+	struct rtnl_link_stats64 stats;
+	struct busload load;
+};
+
+static struct bus_snapshot *snapshots;
+static pthread_t collector_thread;
+static int collector_event = -1; /* shared with the connection processes */
+
+static long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* index of the bus in interface_names or -1 */
+int statistics_bus_index(const char *bus) {
+	int i;
+
+	for(i=0;i<interface_count;i++) {
+		if(!strcmp(interface_names[i], bus))
+			return i;
+	}
+
+	return -1;
+}
+
+static void snapshot_write(struct bus_snapshot *snap, struct rtnl_link_stats64 *stats,
+			   struct busload *load) {
+	__atomic_store_n(&snap->seq, snap->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if(stats) {
+		snap->stats = *stats;
+		snap->stamp = now_ms();
+		snap->valid = 1;
+	}
+	if(load)
+		snap->load = *load;
+
+	__atomic_store_n(&snap->seq, snap->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the counters and the bus load (load may be NULL) published by the
+ * collector. Fails when there is no collector or the counters are older than
+ * max_age ms (0 accepts any age).
+ */
+int statistics_snapshot(int bus, struct rtnl_link_stats64 *stats, struct busload *load, int max_age) {
+	struct bus_snapshot *snap;
+	unsigned int seq;
+	int valid;
+	long long stamp;
+
+	if(snapshots == NULL || bus < 0 || bus >= interface_count)
+		return -1;
+
+	snap = &snapshots[bus];
+
+	do {
+		while((seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+
+		*stats = snap->stats;
+		if(load)
+			*load = snap->load;
+		valid = snap->valid;
+		stamp = snap->stamp;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) != seq);
+
+	if(!valid || (max_age > 0 && now_ms() - stamp > max_age))
+		return -1;
+
+	return 0;
+}
+
+/* interval requested from the collector in ms or 0 when nobody is interested */
+static int collector_ival() {
+	int ival = metrics_min_ival();
+
+	if(metrics_addr && (ival == 0 || ival > COLLECT_METRICS_IVAL))
+		ival = COLLECT_METRICS_IVAL;
+
+	if(ival > 0 && ival < COLLECT_MIN_IVAL)
+		ival = COLLECT_MIN_IVAL;
+
+	return ival;
+}
+
+static void collector_read(int nl, int *ifindex) {
+	struct rtnl_link_stats64 stats;
+	struct can_link_info info;
+	int i;
+
+	for(i=0;i<interface_count;i++) {
+		/* the interface may have been created or recreated */
+		if(!ifindex[i] || statistics_read(nl, ifindex[i], &stats, &info) < 0) {
+			ifindex[i] = if_nametoindex(interface_names[i]);
+			if(!ifindex[i] || statistics_read(nl, ifindex[i], &stats, &info) < 0)
+				continue;
+		}
+
+		busload_set_bitrate(i, info.bitrate, info.data_bitrate);
+		snapshot_write(&snapshots[i], &stats, NULL);
+	}
+}
+
+static void *collector_loop(void *ptr) {
+	struct busload load;
+	struct pollfd pfd[2];
+	eventfd_t val;
+	int ifindex[interface_count];
+	int i, ival, timeout, nl = -1, raw = -1, raw_tried = 0;
+	long long now, next_read = 0, next_slot = 0, slot_start = 0;
+
+	memset(ifindex, 0, sizeof(ifindex));
+	busload_init();
+
+	while(1) {
+		ival = collector_ival();
+
+		if(ival == 0) {
+			if(raw >= 0) {
+				close(raw);
+				raw = -1;
+				busload_reset();
+				for(i=0;i<interface_count;i++) {
+					busload_get(i, &load);
+					snapshot_write(&snapshots[i], NULL, &load);
+				}
 			}
+			raw_tried = 0;
+
+			/* until a connection asks for statistics */
+			pfd[0].fd = collector_event;
+			pfd[0].events = POLLIN;
+			if(poll(pfd, 1, -1) > 0)
+				eventfd_read(collector_event, &val);
+			continue;
 		}
-		fclose(proc_net_dev);
 
-		/* If we didn't find the device there is something wrong. */
-		if(!found) {
-			PRINT_ERROR("could not find device %s in /proc/net/dev\n", bus_name);
+		if(nl < 0 && (nl = statistics_open()) < 0) {
 			sleep(1);
 			continue;
 		}
 
-		gettimeofday(&current_time, 0);
-
-		elapsed = ((current_time.tv_sec - last_fired.tv_sec) * 1000
-			   + (current_time.tv_usec - last_fired.tv_usec)/1000.0) + 0.5;
-
-		if(elapsed >= statistics_ival) {
-
-			/*
-			 * TODO this does not work for virtual devices. therefore it is commented out until
-			 * a solution is found to identify virtual CAN devices
-			 */
-			/*if( can_get_state( current_entry.bus_name, &state ) ) {
-			  printf( "unable to get state of %s\n", current_entry.bus_name );
-			  continue;
-			  }
-			  if( can_get_berr_counter( current_entry.bus_name, &errorcnt ) ) {
-			  printf( "unable to get error count of %s\n", current_entry.bus_name );
-			  continue;
-			  }*/
-
-			snprintf( buffer, STAT_BUF_LEN, "< stat %u %u %u %u >",
-				  proc_entry.rbytes,
-				  proc_entry.rpackets,
-				  proc_entry.tbytes,
-				  proc_entry.tpackets);
-
-			/* no lock needed here because POSIX send is thread-safe and does locking itself */
-			send( client_socket, buffer, strlen(buffer), 0 );
-
-			last_fired.tv_sec = current_time.tv_sec;
-			last_fired.tv_usec = current_time.tv_usec;
+		now = now_ms();
+
+		/* without CAN support only the counters are collected */
+		if(raw < 0 && !raw_tried) {
+			raw_tried = 1;
+			if((raw = busload_open()) >= 0) {
+				slot_start = now;
+				next_slot = now + BUSLOAD_SLOT_MS;
+			}
+		}
+
+		if(now >= next_read) {
+			collector_read(nl, ifindex);
+			next_read = now + ival;
+		}
+
+		if(raw >= 0 && now >= next_slot) {
+			busload_tick(now - slot_start);
+			for(i=0;i<interface_count;i++) {
+				busload_get(i, &load);
+				snapshot_write(&snapshots[i], NULL, &load);
+			}
+			slot_start = now;
+			next_slot += BUSLOAD_SLOT_MS;
+			if(next_slot <= now)
+				next_slot = now + BUSLOAD_SLOT_MS;
 		}
 
-		usleep(10000);
+		timeout = next_read - now;
+		if(raw >= 0 && next_slot - now < timeout)
+			timeout = next_slot - now;
+
+		/* without the bus load socket (fd -1) only the wakeups are waited for */
+		pfd[0].fd = collector_event;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = raw;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if(poll(pfd, 2, timeout) > 0) {
+			/* the interval may have become shorter */
+			if(pfd[0].revents & POLLIN) {
+				eventfd_read(collector_event, &val);
+				next_read = 0;
+			}
+
+			if(pfd[1].revents & POLLIN)
+				busload_receive(raw, ifindex);
+		}
 	}
 
 	return NULL;
 }
+
+/* maps the snapshots before the connection processes are forked */
+void statistics_collector_init() {
+	int i;
+
+	if((collector_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		PRINT_ERROR("Could not create the collector event %s\n", strerror(errno));
+		return;
+	}
+
+	snapshots = mmap(NULL, sizeof(*snapshots) * interface_count, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(snapshots == MAP_FAILED) {
+		PRINT_ERROR("Could not map the bus statistics %s\n", strerror(errno));
+		snapshots = NULL;
+		return;
+	}
+
+	/* no bus load until the first slot has been collected */
+	for(i=0;i<interface_count;i++)
+		snapshots[i].load.load1 = snapshots[i].load.load10 = -1;
+}
+
+/* a connection changed its statistics interval */
+void statistics_collector_wake() {
+	if(collector_event >= 0)
+		eventfd_write(collector_event, 1);
+}
+
+/*
+ * Starts the collector thread once it is needed: for the metrics or the
+ * first connection. Until then the snapshots are invalid and
+ * the connections read the statistics themselves.
+ */
+void statistics_collector_start() {
+	static int started;
+	sigset_t sigset, oldset;
+
+	if(snapshots == NULL || __atomic_exchange_n(&started, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* the signals are handled by the accepting main thread */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	if(pthread_create(&collector_thread, NULL, &collector_loop, NULL)) {
+		PRINT_ERROR("could not create statistics collector thread.\n");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
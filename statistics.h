@@ -1,28 +1,61 @@
-#include <pthread.h>
+#include <linux/if_link.h>
 
 #define STAT_BUF_LEN 512
-#define PROC_LINESIZE 256
-#define PROC_LINECOUNT 32
+#define NETLINK_BUF_LEN 16384 /* RTM_NEWLINK of a single interface */
 
-extern int statistics_ival;
-void *statistics_loop(void *ptr);
-
-struct proc_stat_entry {
-	char device_name[6];
-	unsigned int rbytes;
-	unsigned int rpackets;
-	unsigned int rerrs;
-	unsigned int rdrop;
-	unsigned int rfifo;
-	unsigned int rframe;
-	unsigned int rcompressed;
-	unsigned int rmulticast;
-	unsigned int tbytes;
-	unsigned int tpackets;
-	unsigned int terrs;
-	unsigned int tdrop;
-	unsigned int tfifo;
-	unsigned int tcolls;
-	unsigned int tcarrier;
-	unsigned int tcompressed;
+/* CAN specific link information - bitrates are 0 when unknown (e.g. vcan) */
+struct can_link_info {
+	__u32 bitrate;
+	__u32 data_bitrate;
+	int state; /* enum can_state or -1 without controller */
+	__u16 txerr;
+	__u16 rxerr;
+	int up;
+};
+
+/* bus load over BUSLOAD_SHORT and BUSLOAD_LONG slots of BUSLOAD_SLOT_MS */
+#define BUSLOAD_SLOT_MS 100
+#define BUSLOAD_SHORT 10 /* 1s */
+#define BUSLOAD_LONG 100 /* 10s */
+
+struct busload {
+	double load1; /* percent, -1 when the bitrate is unknown */
+	double load10;
+	double fps1; /* frames per second */
+	double fps10;
 };
+
+/* intervals of the statistics collector in ms */
+#define COLLECT_MIN_IVAL 10
+#define COLLECT_METRICS_IVAL 1000
+
+extern int statistics_ival;
+
+int statistics_timer_open();
+void statistics_timer_set(int fd, int ival);
+void statistics_timer_close(int fd);
+int statistics_timer_expired(int fd);
+void statistics_fire(int fd);
+void connstats_send();
+
+int canstate_open();
+void canstate_request(int fd);
+void canstate_receive(int fd);
+
+int statistics_open();
+int statistics_read(int nl, int ifindex, struct rtnl_link_stats64 *stats, struct can_link_info *info);
+
+void statistics_collector_init();
+void statistics_collector_start();
+void statistics_collector_wake();
+int statistics_snapshot(int bus, struct rtnl_link_stats64 *stats, struct busload *load, int max_age);
+int statistics_bus_index(const char *bus);
+
+void busload_init();
+int busload_open();
+void busload_set_bitrate(int bus, __u32 bitrate, __u32 data_bitrate);
+void busload_receive(int fd, int *ifindex);
+void busload_tick(unsigned int ms);
+void busload_reset();
+void busload_get(int bus, struct busload *load);
+void busload_format(char *buffer, struct busload *load);
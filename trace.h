@@ -0,0 +1,30 @@
+/*
+ * Static tracepoints (USDT) on the hot paths, enabled with
+ * './configure --enable-usdt'. The probes are nops in the code and cost
+ * nothing until a tracer attaches, e.g.
+ *
+ *   bpftrace -e 'usdt:./socketcand:socketcand:can_rx { @[arg0] = count(); }'
+ *
+ * Probes (provider 'socketcand'):
+ *   command(element, len)              element extracted by receive_command()
+ *   can_rx(state, id, len)             frame/PDU received from the bus
+ *   can_tx(state, id, len)             frame/PDU written to the bus
+ *   client_send(len, ret, ns)          send() to the client has returned
+ *   state_change(old, new)             mode of the connection changed
+ *   accept(fd)                         connection accepted by the parent
+ *   fork(pid)                          connection process forked
+ *
+ * In ISO-TP mode the id is the channel handle.
+ */
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TRACE1(name, a) DTRACE_PROBE1(socketcand, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(socketcand, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(socketcand, name, a, b, c)
+#else
+#define TRACE1(name, a)
+#define TRACE2(name, a, b)
+#define TRACE3(name, a, b, c)
+#endif
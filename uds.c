@@ -0,0 +1,281 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#include "socketcand.h"
+#include "uds.h"
+
+/*
+ * UDS request/response engine
+ *
+ * A job sends its requests one after the other on an ISO-TP channel. After
+ * the request has been transmitted the response is expected within P2. A
+ * negative response with NRC 0x78 (response pending) extends the deadline
+ * to P2*. Responses are correlated by the service id: the positive response
+ * carries SID + 0x40, the negative response 7F SID NRC. Other PDUs received
+ * on the channel are not taken by the job.
+ */
+
+long long uds_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct uds_job *uds_job_new(int ch, int p2, int p2star, const struct uds_ops *ops, void *priv) {
+	struct uds_job *job = malloc(sizeof(*job));
+
+	if (job == NULL)
+		return NULL;
+
+	memset(job, 0, sizeof(*job));
+	job->ops = ops;
+	job->ch = ch;
+	job->p2 = p2;
+	job->p2star = p2star;
+	job->priv = priv;
+
+	return job;
+}
+
+void uds_job_free(struct uds_job *job) {
+	if (job == NULL)
+		return;
+
+	job->ops->free(job);
+	free(job);
+}
+
+/* send the next request - returns UDS_DONE when the job has finished */
+static int uds_next(struct uds_job *job) {
+	int len;
+	unsigned char *req;
+
+	while ((len = job->ops->next_request(job, &req)) > 0) {
+		job->sid = req[0];
+		job->state = UDS_SENDING;
+		job->deadline = 0;
+
+		if (isotp_send_pdu(job->ch, req, len) == 0)
+			return UDS_CONTINUE;
+
+		if (job->ops->response(job, NULL, 0) < 0)
+			break;
+	}
+
+	job->ops->finish(job);
+	return UDS_DONE;
+}
+
+int uds_start(struct uds_job *job) {
+	return uds_next(job);
+}
+
+/* the request has been transmitted - start P2 */
+void uds_sent(struct uds_job *job) {
+	if (job->state != UDS_SENDING)
+		return;
+
+	job->state = UDS_WAITING;
+	job->deadline = uds_now() + job->p2;
+}
+
+int uds_response(struct uds_job *job, unsigned char *data, int len) {
+	if (len < 1)
+		return UDS_NOT_MINE;
+
+	if (data[0] == UDS_SID_NEGATIVE) {
+		if (len < 3 || data[1] != job->sid)
+			return UDS_NOT_MINE;
+
+		if (data[2] == UDS_NRC_RESPONSE_PENDING) {
+			/* the response can overtake our tx done notification */
+			job->state = UDS_WAITING;
+			job->deadline = uds_now() + job->p2star;
+			return UDS_CONTINUE;
+		}
+	} else if (data[0] != (unsigned char) (job->sid + UDS_POSITIVE_OFFSET)) {
+		return UDS_NOT_MINE;
+	}
+
+	if (job->ops->response(job, data, len) < 0) {
+		job->ops->finish(job);
+		return UDS_DONE;
+	}
+
+	return uds_next(job);
+}
+
+int uds_check_timeout(struct uds_job *job, long long now) {
+	if (job->state != UDS_WAITING || now < job->deadline)
+		return UDS_CONTINUE;
+
+	if (job->ops->response(job, NULL, 0) < 0) {
+		job->ops->finish(job);
+		return UDS_DONE;
+	}
+
+	return uds_next(job);
+}
+
+/* time in ms until the deadline of the job or -1 when there is none */
+int uds_remaining(struct uds_job *job, long long now) {
+	if (job->state != UDS_WAITING)
+		return -1;
+
+	if (job->deadline <= now)
+		return 0;
+
+	return job->deadline - now;
+}
+
+/*
+ * Batch of requests: '< udsbatch p2 p2star req1 req2 ... >'
+ *
+ * The results are reported in the order of the requests when the batch
+ * has finished: '< udsresults n resp1 resp2 ... >' where a response is the
+ * hex data of the positive or negative response or '-' on timeout/error.
+ */
+
+#define UDS_MAX_BATCH 256
+
+struct uds_batch {
+	int count;
+	int current;
+	unsigned char *req[UDS_MAX_BATCH];
+	int req_len[UDS_MAX_BATCH];
+	char *results;
+	int results_len;
+	int results_size;
+};
+
+static int uds_batch_next(struct uds_job *job, unsigned char **req) {
+	struct uds_batch *batch = job->priv;
+
+	if (batch->current >= batch->count)
+		return 0;
+
+	*req = batch->req[batch->current];
+	return batch->req_len[batch->current];
+}
+
+static int uds_batch_response(struct uds_job *job, unsigned char *data, int len) {
+	struct uds_batch *batch = job->priv;
+	char *tmp;
+	int size = batch->results_len + 2 * len + 2;
+
+	if (size > batch->results_size) {
+		size = size * 2;
+		tmp = realloc(batch->results, size);
+		if (tmp == NULL)
+			return -1;
+		batch->results = tmp;
+		batch->results_size = size;
+	}
+
+	batch->results[batch->results_len++] = ' ';
+	if (data)
+		batch->results_len += hex_encode(batch->results + batch->results_len, data, len);
+	else
+		batch->results[batch->results_len++] = '-';
+
+	batch->current++;
+	return 0;
+}
+
+static void uds_batch_finish(struct uds_job *job) {
+	struct uds_batch *batch = job->priv;
+	char head[48];
+	int len;
+
+	if (job->ch == UNTAGGED_CHANNEL)
+		len = sprintf(head, "< udsresults %d", batch->current);
+	else
+		len = sprintf(head, "< chudsresults %d %d", job->ch, batch->current);
+
+	client_send(head, len, MSG_MORE);
+	client_send(batch->results, batch->results_len, MSG_MORE);
+	client_send(" >", 2, 0);
+}
+
+static void uds_batch_free(struct uds_job *job) {
+	struct uds_batch *batch = job->priv;
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		free(batch->req[i]);
+
+	free(batch->results);
+	free(batch);
+}
+
+static const struct uds_ops uds_batch_ops = {
+	.next_request = uds_batch_next,
+	.response = uds_batch_response,
+	.finish = uds_batch_finish,
+	.free = uds_batch_free,
+};
+
+/* parses 'p2 p2star req1 req2 ... >' starting at the given element */
+struct uds_job *uds_batch_new(int ch, char *buf, int element) {
+	struct uds_batch *batch;
+	struct uds_job *job;
+	char *ptr = element_start(buf, element);
+	int p2, p2star, len;
+
+	if (ptr == NULL || sscanf(ptr, "%d %d", &p2, &p2star) != 2 ||
+	    p2 <= 0 || p2star <= 0)
+		return NULL;
+
+	batch = malloc(sizeof(*batch));
+	if (batch == NULL)
+		return NULL;
+	memset(batch, 0, sizeof(*batch));
+
+	job = uds_job_new(ch, p2, p2star, &uds_batch_ops, batch);
+	if (job == NULL) {
+		free(batch);
+		return NULL;
+	}
+
+	/* skip the timing elements */
+	ptr = element_start(buf, element + 2);
+
+	while (ptr && *ptr != '>') {
+		for (len = 0; ptr[len] && ptr[len] != ' '; len++)
+			;
+
+		if (batch->count == UDS_MAX_BATCH || len == 0 || len % 2)
+			goto error;
+
+		batch->req[batch->count] = malloc(len / 2);
+		if (batch->req[batch->count] == NULL)
+			goto error;
+
+		batch->req_len[batch->count] = hex_decode(batch->req[batch->count], ptr, len);
+		if (batch->req_len[batch->count++] < 0)
+			goto error;
+
+		ptr += len;
+		while (*ptr == ' ')
+			ptr++;
+	}
+
+	if (batch->count == 0)
+		goto error;
+
+	return job;
+
+error:
+	uds_job_free(job);
+	return NULL;
+}
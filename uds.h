@@ -0,0 +1,60 @@
+/*
+ * UDS (ISO 14229) request/response engine on top of an ISO-TP channel
+ */
+
+#define UDS_SID_NEGATIVE 0x7F
+#define UDS_NRC_RESPONSE_PENDING 0x78
+#define UDS_POSITIVE_OFFSET 0x40
+
+/* default timing in ms (ISO 14229-2) */
+#define UDS_P2_DEFAULT 50
+#define UDS_P2STAR_DEFAULT 5000
+
+/* return values of the uds_*() functions driving a job */
+#define UDS_NOT_MINE -1
+#define UDS_CONTINUE 0
+#define UDS_DONE 1
+
+/* states of a job */
+#define UDS_SENDING 0 /* request is being transmitted */
+#define UDS_WAITING 1 /* waiting for the response until the deadline */
+
+struct uds_job;
+
+/*
+ * A job is a sequence of requests. The engine sends one request after the
+ * other and takes care of the response correlation, the P2/P2* timeouts
+ * and the response pending (0x78) handling.
+ */
+struct uds_ops {
+	/* provides the next request - returns its length or 0 when finished */
+	int (*next_request)(struct uds_job *job, unsigned char **req);
+	/* response to the current request - data is NULL when it failed or timed out */
+	int (*response)(struct uds_job *job, unsigned char *data, int len);
+	/* the job has finished - report the results to the client */
+	void (*finish)(struct uds_job *job);
+	void (*free)(struct uds_job *job);
+};
+
+struct uds_job {
+	const struct uds_ops *ops;
+	int ch; /* ISO-TP channel */
+	int p2; /* ms */
+	int p2star; /* ms */
+	int state;
+	unsigned char sid; /* service of the current request */
+	long long deadline; /* ms, CLOCK_MONOTONIC */
+	void *priv;
+};
+
+long long uds_now();
+struct uds_job *uds_job_new(int ch, int p2, int p2star, const struct uds_ops *ops, void *priv);
+void uds_job_free(struct uds_job *job);
+int uds_start(struct uds_job *job);
+void uds_sent(struct uds_job *job);
+int uds_response(struct uds_job *job, unsigned char *data, int len);
+int uds_check_timeout(struct uds_job *job, long long now);
+int uds_remaining(struct uds_job *job, long long now);
+
+struct uds_job *uds_batch_new(int ch, char *buf, int element);
+struct uds_job *uds_flash_new(int ch, char *buf, int element);